@@ -2,8 +2,15 @@
 #include <array>
 #include <thread>
 #include <memory>
-#include <tchar.h>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <list>
+#include <atomic>
 #include "massAllocator.h"
+#include "massAllocatorAlgorithms.h"
+#include "massAllocatorSoA.h"
+#include "massArena.h"
 
 struct ObjectA
 {
@@ -11,23 +18,29 @@ struct ObjectA
     double b[1];
 };
 
+//Время по настенным часам в секундах. clock() на Linux считает процессорное время всех потоков.
+double wallClock()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 template <typename F>
 void measureTime(F f, std::string message)
 {
-    auto allocationStart = clock();
+    auto allocationStart = wallClock();
     f();
-    auto allocationEnd = clock();
-    auto time = (double) (allocationEnd - allocationStart) / CLOCKS_PER_SEC;
+    auto allocationEnd = wallClock();
+    auto time = allocationEnd - allocationStart;
     std::cout << message << " took " << time << "sec" << std::endl;
 }
 
-int _tmain(int argc, _TCHAR* argv[])
+int main()
 {
     const int N = 5000000;
     const int ThreadCount = 8;
 
     {//проверка выделения объектов через MassAllocator
-        auto allocationStart = clock();
+        auto allocationStart = wallClock();
         MassAllocator<ObjectA> heap1;
         std::cout << "is_lock_free = " << (heap1.is_lock_free() ? std::string("true") : std::string("false")) << std::endl;
         std::cout << "Object size " << sizeof(ObjectA) << " bytes, allocate for " << N * ThreadCount<< " objects in " << ThreadCount << " threads, total objects size = " << sizeof(ObjectA) * N * ThreadCount / (1024 * 1024.0) << "MB" << std::endl;
@@ -63,7 +76,7 @@ int _tmain(int argc, _TCHAR* argv[])
         for(auto ii = threads.begin(), ie = threads.end(); ii != ie; ++ii)
             (*ii)->join();
 
-        auto allocationEnd = clock();
+        auto allocationEnd = wallClock();
         std::cout << "Objects in mass allocator = " << heap1.size() << " memory used = " << heap1.memUse() / (1024 * 1024.0) << "MB" << std::endl;
 
         {
@@ -88,6 +101,21 @@ int _tmain(int argc, _TCHAR* argv[])
                 };
             measureTime(iterFunc, "Iterator-based processing");
         }
+        {
+            auto iterFunc = 
+                [&]
+                ()
+                {
+                    //обработка элементов поблочно, внутри блока элементы лежат непрерывно
+                    heap1.forEachBlock(
+                        [](ObjectA *objects, size_t count)
+                        {
+                            for(size_t i = 0; i < count; ++i)
+                                objects[i].b[0] = objects[i].a * 42;
+                        });
+                };
+            measureTime(iterFunc, "Block-based processing");
+        }
         
         {
             auto sortFunc = 
@@ -103,13 +131,28 @@ int _tmain(int argc, _TCHAR* argv[])
                 };
             measureTime(sortFunc, "Sort");
         }
+        {
+            auto sortFunc = 
+                [&]
+                ()
+                {
+                    //сортировка всех элементов: куски сортируются на всех ядрах, затем попарно сливаются
+                    parallelSort(
+                        heap1, 
+                        [](const ObjectA &lh, const ObjectA &rh)
+                        { return lh.a > rh.a; }
+                    );
+                };
+            measureTime(sortFunc, "Parallel sort");
+        }
 
-        auto deallocationStart = clock();
-        heap1.clear();
-        auto deallocationEnd = clock();
+        auto deallocationStart = wallClock();
+        //блоки освобождает фоновый поток, хранилище сразу готово к новому заполнению
+        heap1.clearAsync();
+        auto deallocationEnd = wallClock();
         
-        auto allocTime = (double) (allocationEnd - allocationStart) / CLOCKS_PER_SEC;
-        auto deallocTime = (double) (deallocationEnd - deallocationStart) / CLOCKS_PER_SEC;
+        auto allocTime = allocationEnd - allocationStart;
+        auto deallocTime = deallocationEnd - deallocationStart;
         std::cout << "Allocation and deallocation " << N * ThreadCount << " objects took " << allocTime << "+" << deallocTime << " = " <<allocTime + deallocTime << "sec" << std::endl;
 
         //проверяем корректность выделения объектов.
@@ -139,8 +182,207 @@ int _tmain(int argc, _TCHAR* argv[])
         std::cout << "Check allocation continuity finished with success!" << std::endl;
     }
 
+    {//проверка публикации: читатель опубликованной части не должен видеть незаписанных элементов
+        std::cout << "Check commit publication" << std::endl;
+        const int CheckN = N / 50;
+        typedef MassAllocator<ObjectA> Heap;
+        Heap heap1(Heap::defaultBlockSize, Heap::optionTrackCommits);
+        std::atomic<int> writersLeft(ThreadCount);
+        std::atomic<bool> failed(false);
+        //писатели создают элементы тремя способами, поле a записывается ненулевым до публикации
+        auto writer = 
+            [&]
+            (int threadIndx)
+            {
+                for(int i = 0; i < CheckN; ++i)
+                {
+                    if (i % 3 == 0)
+                    {
+                        size_t indx;
+                        ObjectA *obj = heap1.createElement(&indx);
+                        obj->a = i + 1;
+                        heap1.commit(indx);
+                    }
+                    else if (i % 3 == 1)
+                        heap1.emplaceElement(ObjectA{ i + 1, { 0 } });
+                    else
+                    {
+                        auto spans = heap1.createElements(threadIndx + 1);
+                        for(auto ii = spans.begin(), ie = spans.end(); ii != ie; ++ii)
+                        {
+                            for(auto &obj : *ii)
+                                obj.a = i + 1;
+                            heap1.commit(*ii);
+                        }
+                    }
+                }
+                --writersLeft;
+            };
+        //читатель проверяет каждый элемент ниже границы публикации по мере ее продвижения
+        auto reader = 
+            [&]
+            ()
+            {
+                size_t checked = 0;
+                for(bool last = false; !last;)
+                {
+                    last = writersLeft == 0;
+                    for(size_t n = heap1.committedSize(); checked < n; ++checked)
+                    {
+                        if (heap1[checked].a == 0)
+                            failed = true;
+                    }
+                }
+                if (checked != heap1.size())
+                    failed = true;
+            };
+
+        typedef std::shared_ptr<std::thread> ThreadPtr;
+        std::vector<ThreadPtr> threads;
+        for(int i = 0; i < ThreadCount; ++i)
+            threads.push_back(ThreadPtr(new std::thread(writer, i)));
+        threads.push_back(ThreadPtr(new std::thread(reader)));
+        for(auto ii = threads.begin(), ie = threads.end(); ii != ie; ++ii)
+            (*ii)->join();
+
+        if (failed)
+            throw std::string("publication error");
+        std::cout << "Check commit publication finished with success!" << std::endl;
+    }
+
+    {//проверка повторного использования мест: потоки одновременно освобождают и создают элементы
+        std::cout << "Check element recycling" << std::endl;
+        const int OwnedCount = 1000;
+        const int Rounds = N / 50;
+        typedef MassAllocator<ObjectA> Heap;
+        Heap heap1(Heap::defaultBlockSize, Heap::optionRecycle);
+        //каждый поток владеет OwnedCount элементами, в элементе записаны номер потока и позиция у владельца
+        std::array<std::vector<size_t>, ThreadCount> ownedIndxs;
+        for(int j = 0; j < ThreadCount; ++j)
+        {
+            for(int k = 0; k < OwnedCount; ++k)
+            {
+                size_t indx;
+                ObjectA *obj = heap1.createElement(&indx);
+                obj->a = j;
+                obj->b[0] = k;
+                ownedIndxs[j].push_back(indx);
+            }
+        }
+        auto func = 
+            [&]
+            (int threadIndx)
+            {
+                auto &indxs = ownedIndxs[threadIndx];
+                for(int i = 0; i < Rounds; ++i)
+                {
+                    //освобожденное место может достаться любому потоку, включая этот
+                    int k = (int)(((unsigned int)i * 2654435761u) % OwnedCount);
+                    heap1.destroyElement(indxs[k]);
+                    size_t indx;
+                    ObjectA *obj = heap1.createElement(&indx);
+                    obj->a = threadIndx;
+                    obj->b[0] = k;
+                    indxs[k] = indx;
+                }
+            };
+
+        typedef std::shared_ptr<std::thread> ThreadPtr;
+        std::vector<ThreadPtr> threads;
+        for(int i = 0; i < ThreadCount; ++i)
+            threads.push_back(ThreadPtr(new std::thread(func, i)));
+        for(auto ii = threads.begin(), ie = threads.end(); ii != ie; ++ii)
+            (*ii)->join();
+
+        //количество живых элементов не изменилось, индексы уникальны, и каждое место хранит данные своего владельца
+        if (heap1.aliveSize() != (size_t)OwnedCount * ThreadCount)
+            throw std::string("recycling error: alive size");
+        std::vector<size_t> allIndxs;
+        for(int j = 0; j < ThreadCount; ++j)
+        {
+            for(int k = 0; k < OwnedCount; ++k)
+            {
+                size_t indx = ownedIndxs[j][k];
+                if (!heap1.isAlive(indx) || heap1[indx].a != j || heap1[indx].b[0] != k)
+                    throw std::string("recycling error: element owner");
+                allIndxs.push_back(indx);
+            }
+        }
+        std::sort(allIndxs.begin(), allIndxs.end());
+        if (std::adjacent_find(allIndxs.begin(), allIndxs.end()) != allIndxs.end())
+            throw std::string("recycling error: duplicate index");
+        std::cout << "Check element recycling finished with success! Objects in mass allocator = " << heap1.size() << std::endl;
+    }
+
+    {//поля объектов в отдельных столбцах: проход по полю a читает только столбцы a и b
+        MassAllocatorSoA<int, double> heap1;
+        auto spans = heap1.createElements(N * ThreadCount);
+        for(auto ii = spans.begin(), ie = spans.end(); ii != ie; ++ii)
+        {
+            int *a = ii->column<0>();
+            for(size_t i = 0; i < ii->count; ++i)
+                a[i] = (int)(ii->index + i);
+        }
+        auto iterFunc = 
+            [&]
+            ()
+            {
+                //столбцы блока непрерывны, цикл векторизуется
+                heap1.forEachBlock(
+                    [](size_t, size_t count, int *a, double *b)
+                    {
+                        for(size_t i = 0; i < count; ++i)
+                            b[i] = a[i] * 42;
+                    });
+            };
+        measureTime(iterFunc, "SoA column-based processing");
+    }
+
+    {//узлы контейнеров из байтовой арены: освобождение всей памяти одним reset()
+        MassArena arena;
+        auto listFunc = 
+            [&]
+            ()
+            {
+                std::pmr::list<ObjectA> objects(&arena);
+                for(int i = 0; i < N; ++i)
+                    objects.push_back(ObjectA{ i, { 0 } });
+            };
+        measureTime(listFunc, "std::pmr::list on MassArena");
+        arena.reset();
+    }
+
+    {//проверка выделения объектов через локальные кэши потоков
+        auto allocationStart = wallClock();
+        MassAllocator<ObjectA> heap1;
+        auto func = 
+            [&]
+            ()
+            {
+                //каждый поток захватывает элементы порциями и не конкурирует за общий счетчик на каждом выделении
+                MassAllocator<ObjectA>::ThreadCache cache(heap1);
+                for(int i = 0; i < N; ++i)
+                {
+                    ObjectA *obj = cache.createElement();
+                    obj->a = i;
+                }
+            };
+
+        typedef std::shared_ptr<std::thread> ThreadPtr;
+        std::vector<ThreadPtr> threads;
+        for(int i = 0; i < ThreadCount; ++i)
+            threads.push_back(ThreadPtr(new std::thread(func)));
+
+        for(auto ii = threads.begin(), ie = threads.end(); ii != ie; ++ii)
+            (*ii)->join();
+
+        auto allocationEnd = wallClock();
+        auto allocTime = allocationEnd - allocationStart;
+        std::cout << "ThreadCache-based allocation " << N * ThreadCount << " objects took " << allocTime << "sec, objects in mass allocator = " << heap1.size() << std::endl;
+    }
+
     {//проверка выделения объектов через стандартный менеджер памяти
-        auto allocationStart = clock();
+        auto allocationStart = wallClock();
         std::vector<std::vector<ObjectA*>> allocatedObjects;
         allocatedObjects.resize(ThreadCount);
         auto func = 
@@ -167,22 +409,24 @@ int _tmain(int argc, _TCHAR* argv[])
         for(auto ii = threads.begin(), ie = threads.end(); ii != ie; ++ii)
             (*ii)->join();
         
-        auto allocationEnd = clock();
+        auto allocationEnd = wallClock();
 
-        auto deallocationStart = clock();
+        auto deallocationStart = wallClock();
         for(auto ii = allocatedObjects.begin(), ie = allocatedObjects.end(); ii != ie; ++ii)
             for(auto jj = ii->begin(), je = ii->end(); jj != je; ++jj)
                 delete *jj;
 
-        auto deallocationEnd = clock();
+        auto deallocationEnd = wallClock();
 
-        auto allocTime = (double) (allocationEnd - allocationStart) / CLOCKS_PER_SEC;
-        auto deallocTime = (double) (deallocationEnd - deallocationStart) / CLOCKS_PER_SEC;
+        auto allocTime = allocationEnd - allocationStart;
+        auto deallocTime = deallocationEnd - deallocationStart;
         std::cout << "operator new-based allocation and deallocation " << N * ThreadCount << " objects took " << allocTime << "+" << deallocTime << " = " <<allocTime + deallocTime << "sec" << std::endl;
 
     }
 
+#ifdef _WIN32
     std::getchar();
+#endif
     return 0;
 }
 
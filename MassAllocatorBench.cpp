@@ -0,0 +1,543 @@
+﻿#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <memory_resource>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <span>
+#include "massAllocator.h"
+#include "massAllocatorSharded.h"
+
+/*
+Набор замеров производительности MassAllocator.
+Перебирает размер объекта, размер блока и количество потоков, сравнивает с new, malloc и
+std::pmr::monotonic_buffer_resource. Замеры indexLoop и indexGather сравнивают чтение элементов по случайным
+индексам циклом operator[] и через gather() с предвыборкой. Время измеряется по настенным часам (steady_clock), каждый замер
+повторяется после прогревочных запусков. Результат пишется в CSV или JSON.
+
+Параметры:
+    --quick             уменьшенный набор для быстрой проверки
+    --ops N             количество операций на поток
+    --warmup N          количество прогревочных запусков
+    --repeats N         количество измеряемых запусков
+    --threads N         наибольшее количество потоков
+    --case NAME         запускать только указанный замер (можно повторять)
+    --format csv|json   формат результата
+    --output FILE       файл результата, по умолчанию стандартный вывод
+*/
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    ///Объект заданного размера
+    template <size_t Size>
+    struct Object
+    {
+        char data[Size];
+    };
+
+    ///Параметры одного замера
+    struct Params
+    {
+        size_t objectSize;
+        unsigned int blockSize;
+        unsigned int threads;
+        size_t opsPerThread;
+    };
+
+    ///Результат одного запуска
+    struct Sample
+    {
+        double seconds;
+        std::vector<uint64_t> latencies;
+    };
+
+    ///Сводный результат замера
+    struct Result
+    {
+        std::string name;
+        Params params;
+        double nsPerOpMedian;
+        double nsPerOpMin;
+        double mopsPerSec;
+        uint64_t p50;
+        uint64_t p99;
+        uint64_t p999;
+        uint64_t maxLatency;
+    };
+
+    ///Задержка измеряется у каждой latencyStep-й операции, чтобы чтение часов не искажало общее время
+    const size_t latencyStep = 64;
+
+    uint64_t nanoseconds(Clock::time_point start, Clock::time_point end)
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+
+    ///Выполняет op(i) для i = 0..ops-1, измеряя задержку части операций
+    template <typename Op>
+    void timedLoop(size_t ops, std::vector<uint64_t> &latencies, Op op)
+    {
+        latencies.reserve(ops / latencyStep + 1);
+        for (size_t i = 0; i < ops; ++i)
+        {
+            if (i % latencyStep == 0)
+            {
+                auto start = Clock::now();
+                op(i);
+                latencies.push_back(nanoseconds(start, Clock::now()));
+            }
+            else
+                op(i);
+        }
+    }
+
+    /*! \brief Запускает body(threadIndx, latencies) на threads потоках и измеряет общее время.
+    *setup(threadIndx) и teardown(threadIndx) выполняются вне измерения.
+    */
+    template <typename Setup, typename Body, typename Teardown>
+    Sample runThreads(unsigned int threads, Setup setup, Body body, Teardown teardown)
+    {
+        std::vector<std::vector<uint64_t>> latencies(threads);
+        std::atomic<unsigned int> ready(0);
+        std::atomic<bool> go(false);
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < threads; ++t)
+        {
+            workers.push_back(std::thread(
+                [&, t]
+                ()
+                {
+                    setup(t);
+                    ++ready;
+                    while (!go.load(std::memory_order_acquire))
+                        std::this_thread::yield();
+                    body(t, latencies[t]);
+                }));
+        }
+        while (ready.load() != threads)
+            std::this_thread::yield();
+        auto start = Clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto ii = workers.begin(), ie = workers.end(); ii != ie; ++ii)
+            ii->join();
+        auto end = Clock::now();
+        for (unsigned int t = 0; t < threads; ++t)
+            teardown(t);
+
+        Sample result;
+        result.seconds = nanoseconds(start, end) / 1e9;
+        for (auto ii = latencies.begin(), ie = latencies.end(); ii != ie; ++ii)
+            result.latencies.insert(result.latencies.end(), ii->begin(), ii->end());
+        return result;
+    }
+
+    //=========================================================================
+    // Замеры выделения
+
+    template <size_t Size>
+    Sample benchMassAllocator(const Params &params)
+    {
+        typedef Object<Size> Obj;
+        std::unique_ptr<MassAllocator<Obj>> heap(new MassAllocator<Obj>(params.blockSize));
+        return runThreads(params.threads,
+            [](unsigned int) {},
+            [&](unsigned int, std::vector<uint64_t> &latencies)
+            {
+                timedLoop(params.opsPerThread, latencies, [&](size_t i) { heap->createElement()->data[0] = (char)i; });
+            },
+            [](unsigned int) {});
+    }
+
+    template <size_t Size>
+    Sample benchMassThreadCache(const Params &params)
+    {
+        typedef Object<Size> Obj;
+        std::unique_ptr<MassAllocator<Obj>> heap(new MassAllocator<Obj>(params.blockSize));
+        return runThreads(params.threads,
+            [](unsigned int) {},
+            [&](unsigned int, std::vector<uint64_t> &latencies)
+            {
+                typename MassAllocator<Obj>::ThreadCache cache(*heap);
+                timedLoop(params.opsPerThread, latencies, [&](size_t i) { cache.createElement()->data[0] = (char)i; });
+            },
+            [](unsigned int) {});
+    }
+
+    template <size_t Size>
+    Sample benchMassSharded(const Params &params)
+    {
+        typedef Object<Size> Obj;
+        //шард на каждый узел NUMA, на машине с одним узлом совпадает с massAllocator
+        std::unique_ptr<MassAllocatorSharded<Obj>> heap(new MassAllocatorSharded<Obj>(MassAllocatorSharded<Obj>::shardByNode, 0, params.blockSize));
+        return runThreads(params.threads,
+            [](unsigned int) {},
+            [&](unsigned int, std::vector<uint64_t> &latencies)
+            {
+                timedLoop(params.opsPerThread, latencies, [&](size_t i) { heap->createElement()->data[0] = (char)i; });
+            },
+            [](unsigned int) {});
+    }
+
+    template <size_t Size>
+    Sample benchMassBulk(const Params &params)
+    {
+        typedef Object<Size> Obj;
+        //задержка пакета делится на его размер, то есть в результате задержка в пересчете на элемент
+        const size_t batch = 1024;
+        std::unique_ptr<MassAllocator<Obj>> heap(new MassAllocator<Obj>(params.blockSize));
+        return runThreads(params.threads,
+            [](unsigned int) {},
+            [&](unsigned int, std::vector<uint64_t> &latencies)
+            {
+                for (size_t done = 0; done < params.opsPerThread; done += batch)
+                {
+                    auto start = Clock::now();
+                    auto spans = heap->createElements(std::min(batch, params.opsPerThread - done));
+                    for (auto &span : spans)
+                        for (auto &obj : span)
+                            obj.data[0] = 1;
+                    latencies.push_back(nanoseconds(start, Clock::now()) / batch);
+                }
+            },
+            [](unsigned int) {});
+    }
+
+    template <size_t Size>
+    Sample benchNew(const Params &params)
+    {
+        typedef Object<Size> Obj;
+        std::vector<std::vector<Obj*>> objects(params.threads);
+        return runThreads(params.threads,
+            [&](unsigned int t) { objects[t].reserve(params.opsPerThread); },
+            [&](unsigned int t, std::vector<uint64_t> &latencies)
+            {
+                auto &own = objects[t];
+                timedLoop(params.opsPerThread, latencies,
+                    [&](size_t i)
+                    {
+                        Obj *obj = new Obj();
+                        obj->data[0] = (char)i;
+                        own.push_back(obj);
+                    });
+            },
+            [&](unsigned int t)
+            {
+                for (auto ii = objects[t].begin(), ie = objects[t].end(); ii != ie; ++ii)
+                    delete *ii;
+            });
+    }
+
+    template <size_t Size>
+    Sample benchMalloc(const Params &params)
+    {
+        std::vector<std::vector<char*>> objects(params.threads);
+        return runThreads(params.threads,
+            [&](unsigned int t) { objects[t].reserve(params.opsPerThread); },
+            [&](unsigned int t, std::vector<uint64_t> &latencies)
+            {
+                auto &own = objects[t];
+                timedLoop(params.opsPerThread, latencies,
+                    [&](size_t i)
+                    {
+                        char *obj = (char*)malloc(Size);
+                        obj[0] = (char)i;
+                        own.push_back(obj);
+                    });
+            },
+            [&](unsigned int t)
+            {
+                for (auto ii = objects[t].begin(), ie = objects[t].end(); ii != ie; ++ii)
+                    free(*ii);
+            });
+    }
+
+    template <size_t Size>
+    Sample benchPmrMonotonic(const Params &params)
+    {
+        typedef Object<Size> Obj;
+        //monotonic_buffer_resource не потокобезопасен, поэтому у каждого потока свой
+        std::vector<std::unique_ptr<std::pmr::monotonic_buffer_resource>> resources(params.threads);
+        return runThreads(params.threads,
+            [&](unsigned int t) { resources[t].reset(new std::pmr::monotonic_buffer_resource()); },
+            [&](unsigned int t, std::vector<uint64_t> &latencies)
+            {
+                auto &resource = *resources[t];
+                timedLoop(params.opsPerThread, latencies,
+                    [&](size_t i) { ((Obj*)resource.allocate(sizeof(Obj), alignof(Obj)))->data[0] = (char)i; });
+            },
+            [&](unsigned int t) { resources[t].reset(); });
+    }
+
+    //=========================================================================
+    // Замеры чтения по списку индексов
+
+    /*! \brief Копирует элементы по случайным индексам пакетами, через gather() или циклом operator[].
+    *Хранилище из opsPerThread * threads элементов и индексы потоков заполняются вне измерения.
+    */
+    template <size_t Size, bool UseGather>
+    Sample benchIndexedRead(const Params &params)
+    {
+        typedef Object<Size> Obj;
+        const size_t batch = 1024;
+        size_t count = params.opsPerThread * params.threads;
+        std::unique_ptr<MassAllocator<Obj>> heap(new MassAllocator<Obj>(params.blockSize));
+        auto spans = heap->createElements(count);
+        for (auto &span : spans)
+            for (size_t i = 0; i < span.count; ++i)
+                span.ptr[i].data[0] = (char)(span.index + i);
+
+        std::vector<std::vector<size_t>> indices(params.threads);
+        std::vector<std::vector<Obj>> buffers(params.threads);
+        std::vector<char> sinks(params.threads);
+        return runThreads(params.threads,
+            [&](unsigned int t)
+            {
+                std::mt19937_64 random(t + 1);
+                indices[t].resize(params.opsPerThread);
+                for (auto ii = indices[t].begin(), ie = indices[t].end(); ii != ie; ++ii)
+                    *ii = (size_t)(random() % count);
+                buffers[t].resize(batch);
+            },
+            [&](unsigned int t, std::vector<uint64_t> &latencies)
+            {
+                //задержка пакета делится на его размер, то есть в результате задержка в пересчете на элемент
+                auto &own = indices[t];
+                auto &out = buffers[t];
+                char sink = 0;
+                for (size_t done = 0; done < own.size(); done += batch)
+                {
+                    size_t n = std::min(batch, own.size() - done);
+                    auto start = Clock::now();
+                    if constexpr (UseGather)
+                        heap->gather(std::span<const size_t>(own.data() + done, n), out.begin());
+                    else
+                    {
+                        for (size_t i = 0; i < n; ++i)
+                            out[i] = (*heap)[own[done + i]];
+                    }
+                    latencies.push_back(nanoseconds(start, Clock::now()) / n);
+                    sink += out[n - 1].data[0];
+                }
+                sinks[t] = sink;
+            },
+            [](unsigned int) {});
+    }
+
+    template <size_t Size>
+    Sample benchIndexLoop(const Params &params)
+    {
+        return benchIndexedRead<Size, false>(params);
+    }
+
+    template <size_t Size>
+    Sample benchIndexGather(const Params &params)
+    {
+        return benchIndexedRead<Size, true>(params);
+    }
+
+    //=========================================================================
+
+    ///Описание замера
+    struct Case
+    {
+        std::string name;
+        ///Зависит ли замер от размера блока MassAllocator
+        bool usesBlockSize;
+        std::function<Sample(const Params &)> run16;
+        std::function<Sample(const Params &)> run64;
+        std::function<Sample(const Params &)> run256;
+    };
+
+#define MASS_BENCH_CASE(name, usesBlockSize, func) \
+    Case { name, usesBlockSize, func<16>, func<64>, func<256> }
+
+    std::vector<Case> allCases()
+    {
+        std::vector<Case> cases;
+        cases.push_back(MASS_BENCH_CASE("massAllocator", true, benchMassAllocator));
+        cases.push_back(MASS_BENCH_CASE("massThreadCache", true, benchMassThreadCache));
+        cases.push_back(MASS_BENCH_CASE("massBulk", true, benchMassBulk));
+        cases.push_back(MASS_BENCH_CASE("massSharded", true, benchMassSharded));
+        cases.push_back(MASS_BENCH_CASE("new", false, benchNew));
+        cases.push_back(MASS_BENCH_CASE("malloc", false, benchMalloc));
+        cases.push_back(MASS_BENCH_CASE("pmrMonotonic", false, benchPmrMonotonic));
+        cases.push_back(MASS_BENCH_CASE("indexLoop", true, benchIndexLoop));
+        cases.push_back(MASS_BENCH_CASE("indexGather", true, benchIndexGather));
+        return cases;
+    }
+
+    uint64_t percentile(const std::vector<uint64_t> &sorted, double p)
+    {
+        if (sorted.empty())
+            return 0;
+        size_t pos = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+        return sorted[pos];
+    }
+
+    Result measure(const Case &benchCase, const Params &params, unsigned int warmup, unsigned int repeats)
+    {
+        auto &run = params.objectSize == 16 ? benchCase.run16 : params.objectSize == 64 ? benchCase.run64 : benchCase.run256;
+        for (unsigned int i = 0; i < warmup; ++i)
+            run(params);
+
+        std::vector<double> nsPerOp;
+        std::vector<uint64_t> latencies;
+        double totalOps = (double)params.opsPerThread * params.threads;
+        for (unsigned int i = 0; i < repeats; ++i)
+        {
+            Sample sample = run(params);
+            nsPerOp.push_back(sample.seconds * 1e9 / totalOps);
+            latencies.insert(latencies.end(), sample.latencies.begin(), sample.latencies.end());
+        }
+        std::sort(nsPerOp.begin(), nsPerOp.end());
+        std::sort(latencies.begin(), latencies.end());
+
+        Result result;
+        result.name = benchCase.name;
+        result.params = params;
+        result.nsPerOpMedian = nsPerOp[nsPerOp.size() / 2];
+        result.nsPerOpMin = nsPerOp.front();
+        result.mopsPerSec = 1e3 / result.nsPerOpMedian;
+        result.p50 = percentile(latencies, 0.5);
+        result.p99 = percentile(latencies, 0.99);
+        result.p999 = percentile(latencies, 0.999);
+        result.maxLatency = latencies.empty() ? 0 : latencies.back();
+        return result;
+    }
+
+    void writeCsv(std::ostream &out, const std::vector<Result> &results)
+    {
+        out << "case,object_size,block_size,threads,ops_per_thread,ns_per_op_median,ns_per_op_min,mops_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n";
+        for (auto ii = results.begin(), ie = results.end(); ii != ie; ++ii)
+        {
+            out << ii->name << ',' << ii->params.objectSize << ',' << ii->params.blockSize << ',' << ii->params.threads << ','
+                << ii->params.opsPerThread << ',' << ii->nsPerOpMedian << ',' << ii->nsPerOpMin << ',' << ii->mopsPerSec << ','
+                << ii->p50 << ',' << ii->p99 << ',' << ii->p999 << ',' << ii->maxLatency << '\n';
+        }
+    }
+
+    void writeJson(std::ostream &out, const std::vector<Result> &results)
+    {
+        out << "[\n";
+        for (auto ii = results.begin(), ie = results.end(); ii != ie; ++ii)
+        {
+            out << "  {\"case\": \"" << ii->name << "\", \"object_size\": " << ii->params.objectSize
+                << ", \"block_size\": " << ii->params.blockSize << ", \"threads\": " << ii->params.threads
+                << ", \"ops_per_thread\": " << ii->params.opsPerThread << ", \"ns_per_op_median\": " << ii->nsPerOpMedian
+                << ", \"ns_per_op_min\": " << ii->nsPerOpMin << ", \"mops_per_sec\": " << ii->mopsPerSec
+                << ", \"p50_ns\": " << ii->p50 << ", \"p99_ns\": " << ii->p99 << ", \"p999_ns\": " << ii->p999
+                << ", \"max_ns\": " << ii->maxLatency << "}" << (ii + 1 != ie ? "," : "") << '\n';
+        }
+        out << "]\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t opsPerThread = 1000000;
+    unsigned int warmup = 1;
+    unsigned int repeats = 5;
+    unsigned int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> objectSizes = { 16, 64, 256 };
+    std::vector<unsigned int> blockSizes = { 4 * 1024, 128 * 1024 };
+    std::vector<std::string> selected;
+    std::string format = "csv";
+    std::string output;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string
+        {
+            if (i + 1 >= argc)
+            {
+                std::cerr << "missing value for " << arg << std::endl;
+                exit(2);
+            }
+            return argv[++i];
+        };
+        if (arg == "--quick")
+        {
+            opsPerThread = 100000;
+            repeats = 3;
+            objectSizes = { 16, 256 };
+            blockSizes = { 128 * 1024 };
+        }
+        else if (arg == "--ops")
+            opsPerThread = std::stoull(value());
+        else if (arg == "--warmup")
+            warmup = std::stoul(value());
+        else if (arg == "--repeats")
+            repeats = std::max(1ul, std::stoul(value()));
+        else if (arg == "--threads")
+            maxThreads = std::max(1ul, std::stoul(value()));
+        else if (arg == "--case")
+            selected.push_back(value());
+        else if (arg == "--format")
+            format = value();
+        else if (arg == "--output")
+            output = value();
+        else
+        {
+            std::cerr << "unknown argument " << arg << std::endl;
+            return 2;
+        }
+    }
+
+    //1, 2, 4 ... и наибольшее количество потоков
+    std::vector<unsigned int> threadCounts;
+    for (unsigned int t = 1; t < maxThreads; t *= 2)
+        threadCounts.push_back(t);
+    threadCounts.push_back(maxThreads);
+
+    std::vector<Result> results;
+    auto cases = allCases();
+    for (auto ii = cases.begin(), ie = cases.end(); ii != ie; ++ii)
+    {
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), ii->name) == selected.end())
+            continue;
+        for (size_t objectSize : objectSizes)
+        {
+            std::vector<unsigned int> caseBlockSizes = ii->usesBlockSize ? blockSizes : std::vector<unsigned int>(1, 0);
+            for (unsigned int blockSize : caseBlockSizes)
+            {
+                for (unsigned int threads : threadCounts)
+                {
+                    Params params = { objectSize, blockSize, threads, opsPerThread };
+                    Result result = measure(*ii, params, warmup, repeats);
+                    std::cerr << result.name << " size=" << objectSize << " block=" << blockSize << " threads=" << threads
+                              << ": " << result.nsPerOpMedian << " ns/op, " << result.mopsPerSec << " Mops/s, p99 "
+                              << result.p99 << " ns" << std::endl;
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+
+    std::ofstream file;
+    if (!output.empty())
+    {
+        file.open(output.c_str());
+        if (!file)
+        {
+            std::cerr << "cannot open " << output << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out = output.empty() ? std::cout : file;
+    if (format == "json")
+        writeJson(out, results);
+    else
+        writeCsv(out, results);
+    return 0;
+}
@@ -4,27 +4,473 @@
 #include <atomic>
 #include <cstdlib>
 #include <thread>
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <mutex>
+#include <exception>
+#include <chrono>
+#include <list>
+#include <bit>
+#include <type_traits>
+#include <utility>
+#include <system_error>
+#include <typeinfo>
+#include <limits>
+#include <memory>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-/*! \brief Хранилище для объектов с быстрым выделением нового элемента. 
-*Поддерживаются только операции выделеления нового элемента и полной очистки.
-*Тип T не должен иметь конструктора. Элемент инициализируется нулями.
+/*! \brief Статистика выделения элементов.
+*Собирается, только если при компиляции определен MASS_ALLOCATOR_STATS, иначе счетчики не компилируются и все поля нулевые.
+*/
+struct MassAllocatorStats
+{
+    ///Количество выделенных и записанных в хранилище блоков
+    uint64_t blocksAllocated;
+    ///Количество блоков, выделенных одновременно с другим потоком и освобожденных, потому что тот записал свой блок раньше
+    uint64_t blocksDiscarded;
+    ///Количество обнуленных при повторном использовании блоков
+    uint64_t blocksZeroed;
+    ///Время выделения и обнуления блоков, нс
+    uint64_t blockAllocationNs;
+    ///Количество пробуждений потоков, ожидающих выделения блока другим потоком
+    uint64_t waitIterations;
+    ///Время ожидания выделения блока другим потоком, нс
+    uint64_t waitNs;
+    ///Количество элементов, возвращенных хранилищу локальными кэшами потоков
+    uint64_t cacheSlotsReturned;
+    ///Количество элементов, захваченных локальными кэшами потоков и не выданных (учитываются в size(), но не записаны)
+    uint64_t cacheSlotsAbandoned;
+    ///Количество элементов, захваченных каждым потоком
+    std::vector<std::pair<std::thread::id, uint64_t>> threadAllocations;
+};
+
+/*! \brief Заголовок файла хранилища.
+*Занимает первую страницу файла, за ним с шагом blockStride идут блоки, выровненные на размер страницы.
+*/
+struct MassAllocatorFileHeader
+{
+    ///Сигнатура файла "MASSALC1"
+    char magic[8];
+    ///Версия формата
+    uint32_t version;
+    ///Количество элементов в блоке
+    uint32_t blockSize;
+    ///Размер элемента в байтах
+    uint32_t elementSize;
+    ///Смещение первого блока от начала файла
+    uint32_t headerSize;
+    ///Расстояние между началами соседних блоков в файле
+    uint64_t blockStride;
+    ///Количество элементов на момент последнего save()
+    uint64_t count;
+    ///Отпечаток типа элемента
+    uint64_t typeFingerprint;
+};
+
+#ifdef MASS_ALLOCATOR_STATS
+#define MASS_ALLOCATOR_STAT(expr) expr
+#else
+#define MASS_ALLOCATOR_STAT(expr)
+#endif
+
+/*! \brief Выполняет f(taskIndx) для задач 0..tasksCount-1 на нескольких потоках.
+*Задачи раздаются потокам по одной через общий атомарный счетчик, вызывающий поток тоже выполняет задачи.
+*threadsCount = 0 означает количество аппаратных потоков. Первое исключение из задач пробрасывается вызывающему.
+*/
+template <typename F>
+void massParallelFor(size_t tasksCount, F f, unsigned int threadsCount = 0)
+{
+    if (threadsCount == 0)
+        threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    threadsCount = (unsigned int)std::min<size_t>(threadsCount, tasksCount);
+    if (threadsCount <= 1)
+    {
+        for (size_t i = 0; i < tasksCount; ++i)
+            f(i);
+        return;
+    }
+
+    std::atomic<size_t> nextTask(0);
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto worker = 
+        [&]
+        ()
+        {
+            try
+            {
+                for (size_t i = nextTask++; i < tasksCount; i = nextTask++)
+                    f(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+                //останавливаем раздачу оставшихся задач
+                nextTask = tasksCount;
+            }
+        };
+
+    std::vector<std::thread> threads;
+    threads.reserve(threadsCount - 1);
+    for (unsigned int i = 1; i < threadsCount; ++i)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (auto ii = threads.begin(), ie = threads.end(); ii != ie; ++ii)
+        ii->join();
+    if (error)
+        std::rethrow_exception(error);
+}
+//=============================================================================
+
+#ifdef __linux__
+///Отображает страницы участка памяти в физическую память, записывая по байту в каждую страницу.
+inline void prefaultPages(void *memory, size_t size)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(memory, size, MADV_POPULATE_WRITE) == 0)
+        return;
+#endif
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    volatile char *bytes = (volatile char*)memory;
+    for (size_t offset = 0; offset < size; offset += pageSize)
+        bytes[offset] = 0;
+}
+#endif
+
+/*! \brief Каталог блоков фиксированной емкости.
+*Двухуровневая таблица атомарных указателей: страницы таблицы выделяются по мере надобности и никогда не перемещаются,
+*поэтому читатели обращаются к каталогу без блокировок, в том числе во время добавления новых блоков.
 */
 template <typename T>
+class MassBlockDirectory
+{
+public:
+    ///Конструктор.
+    MassBlockDirectory();
+    ///Деструктор. Освобождает страницы таблицы, но не сами блоки.
+    ~MassBlockDirectory();
+
+    ///Возвращает указатель на блок по номеру.
+    T* operator[](unsigned int blockIndx) const
+    {
+        return pages_[blockIndx >> pageShift].load(std::memory_order_acquire)[blockIndx & pageMask].load(std::memory_order_acquire);
+    }
+
+    ///Возвращает указатель на блок по номеру или nullptr, если блок еще не записан.
+    ///В отличие от operator[] допускает номера блоков, для которых еще нет страницы таблицы.
+    T* find(unsigned int blockIndx) const
+    {
+        if (blockIndx >= capacity())
+            return nullptr;
+        std::atomic<T*> *page = pages_[blockIndx >> pageShift].load(std::memory_order_acquire);
+        return page != nullptr ? page[blockIndx & pageMask].load(std::memory_order_acquire) : nullptr;
+    }
+
+    ///Записывает указатель на блок. При необходимости выделяет страницу таблицы.
+    void set(unsigned int blockIndx, T *block);
+
+    ///Записывает указатель на блок, только если блок с этим номером еще не записан.
+    ///Возвращает false, если другой поток успел записать свой блок раньше.
+    bool install(unsigned int blockIndx, T *block);
+
+    ///Обменивается содержимым с other. Переставляются только страницы таблицы, блоки не перебираются.
+    ///Нельзя вызывать одновременно с обращениями к каталогам.
+    void swap(MassBlockDirectory &other);
+
+    ///Наибольшее количество блоков в каталоге.
+    static size_t capacity() { return (size_t)pagesCount * pageSize; }
+private:
+    //Запрет копирования
+    MassBlockDirectory(const MassBlockDirectory &);
+    MassBlockDirectory& operator=(const MassBlockDirectory &);
+
+    static const unsigned int pageShift = 12;
+    static const unsigned int pageSize = 1u << pageShift;
+    static const unsigned int pageMask = pageSize - 1;
+    static const unsigned int pagesCount = 1024;
+
+    ///Страницы таблицы указателей на блоки.
+    std::atomic<std::atomic<T*>*> pages_[pagesCount];
+
+    ///Возвращает ячейку таблицы для блока. При необходимости выделяет страницу таблицы.
+    std::atomic<T*>& slot(unsigned int blockIndx);
+};
+
+template <typename T>
+MassBlockDirectory<T>::MassBlockDirectory()
+{
+    for (unsigned int i = 0; i < pagesCount; ++i)
+        pages_[i].store(nullptr, std::memory_order_relaxed);
+}
+
+template <typename T>
+MassBlockDirectory<T>::~MassBlockDirectory()
+{
+    for (unsigned int i = 0; i < pagesCount; ++i)
+        delete[] pages_[i].load(std::memory_order_relaxed);
+}
+
+template <typename T>
+void MassBlockDirectory<T>::set(unsigned int blockIndx, T *block)
+{
+    slot(blockIndx).store(block, std::memory_order_release);
+}
+
+template <typename T>
+bool MassBlockDirectory<T>::install(unsigned int blockIndx, T *block)
+{
+    T *expected = nullptr;
+    return slot(blockIndx).compare_exchange_strong(expected, block, std::memory_order_acq_rel);
+}
+
+template <typename T>
+void MassBlockDirectory<T>::swap(MassBlockDirectory &other)
+{
+    for (unsigned int i = 0; i < pagesCount; ++i)
+        pages_[i].store(other.pages_[i].exchange(pages_[i].load(std::memory_order_relaxed), std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+template <typename T>
+std::atomic<T*>& MassBlockDirectory<T>::slot(unsigned int blockIndx)
+{
+    if (blockIndx >= capacity())
+        throw std::bad_alloc();
+    auto &pageSlot = pages_[blockIndx >> pageShift];
+    std::atomic<T*> *page = pageSlot.load(std::memory_order_acquire);
+    if (page == nullptr)
+    {
+        //страницу может одновременно выделять другой поток, побеждает первый
+        std::atomic<T*> *newPage = new std::atomic<T*>[pageSize];
+        for (unsigned int i = 0; i < pageSize; ++i)
+            newPage[i].store(nullptr, std::memory_order_relaxed);
+        if (pageSlot.compare_exchange_strong(page, newPage, std::memory_order_acq_rel))
+            page = newPage;
+        else
+            delete[] newPage;
+    }
+    return page[blockIndx & pageMask];
+}
+//=============================================================================
+
+/*! \brief Компактная типизированная ссылка на элемент MassAllocator<T> шириной IndexType.
+*Хранит индекс элемента плюс один, поэтому нулевое значение, в том числе в заполненном нулями элементе, означает пустую ссылку.
+*Разыменование через хранилище: heap[handle] или heap.get(handle).
+*/
+template <typename T, typename IndexType = uint32_t>
+class MassHandle
+{
+    static_assert(std::is_unsigned_v<IndexType>, "handle width must be an unsigned integer type");
+public:
+    typedef IndexType value_type;
+
+    ///Пустая ссылка.
+    MassHandle() noexcept : value_(0) {}
+
+    ///Ссылка на элемент с индексом index. Если индекс не помещается в IndexType, бросается std::bad_alloc.
+    static MassHandle fromIndex(size_t index)
+    {
+        if (index >= (size_t)std::numeric_limits<IndexType>::max())
+            throw std::bad_alloc();
+        MassHandle result;
+        result.value_ = (IndexType)(index + 1);
+        return result;
+    }
+
+    ///Индекс элемента. Для пустой ссылки не определен.
+    size_t index() const { return (size_t)value_ - 1; }
+
+    bool isNull() const { return value_ == 0; }
+    explicit operator bool() const { return value_ != 0; }
+
+    bool operator==(const MassHandle &rh) const { return value_ == rh.value_; }
+    bool operator!=(const MassHandle &rh) const { return value_ != rh.value_; }
+    bool operator<(const MassHandle &rh) const { return value_ < rh.value_; }
+private:
+    IndexType value_;
+};
+
+//=============================================================================
+
+/*! \brief Хранилище для объектов с быстрым выделением нового элемента. 
+*Поддерживаются операции выделеления нового элемента и полной очистки, а с optionRecycle и освобождение отдельных элементов.
+*Элементы типа с тривиальным конструктором по умолчанию не конструируются, а берутся из заполненной нулями памяти.
+*Для остальных типов createElement() вызывает T(), который не должен бросать исключений, а emplaceElement() конструирует элемент
+*на месте из переданных аргументов. Деструкторы нетривиально разрушаемых элементов вызываются в clear(), reset() и destroyElement().
+*Если BlockShift не равен нулю, то размер блока задается на этапе компиляции и равен 2^BlockShift,
+*тогда номер блока и индекс в блоке вычисляются сдвигом и маской вместо деления.
+*/
+template <typename T, unsigned int BlockShift = 0>
 class MassAllocator
 {
+    static_assert(BlockShift <= 30, "block size must leave room for claims past the block end in the lower half of the index");
 public:
     typedef size_t size_type ;
     typedef T& reference;
     typedef const T& const_reference;
     typedef T* pointer;
 
-    ///Конструктор. 
-    MassAllocator(unsigned int blockSize = 1024 * 128);
+    ///Размер блока по умолчанию.
+    static const unsigned int defaultBlockSize = BlockShift != 0 ? 1u << BlockShift : 1024 * 128;
+
+    ///Наибольший размер блока.
+    static const unsigned int maxBlockSize = 1u << 30;
+
+    ///Способ выделения памяти под блоки, флаги объединяются через |.
+    enum Options
+    {
+        ///malloc с заполнением нулями
+        optionDefault = 0,
+        ///Анонимное отображение mmap. Свежие страницы уже заполнены нулями, поэтому memset не нужен. Только Linux.
+        optionMmap = 1,
+        ///Просить у ядра большие страницы для блоков (MADV_HUGEPAGE), вместе с optionMmap.
+        optionHugePages = 2,
+        ///Сразу отображать все страницы блока (MAP_POPULATE), вместе с optionMmap.
+        optionPopulate = 4,
+        ///Готовить следующий блок в отдельном фоновом потоке, а не в потоке, пересекшем порог подготовки.
+        optionBackgroundRefill = 8,
+        ///Отслеживать публикацию элементов: committedSize() и итераторы по опубликованным элементам.
+        ///Элементы createElement(), createElements() и ThreadCache публикуются через commit(), emplaceElement() - сразу после конструирования.
+        optionTrackCommits = 16,
+        ///Разрешить освобождение отдельных элементов через destroyElement() и повторное использование их мест.
+        optionRecycle = 32
+    };
+
+    ///Конструктор. Для размера блока, заданного на этапе компиляции, параметр blockSize игнорируется.
+    ///Размер блока 0 или больше maxBlockSize приводит к std::bad_alloc.
+    MassAllocator(unsigned int blockSize = defaultBlockSize, unsigned int options = optionDefault);
     ///Деструктор.
     ~MassAllocator();
 
-    ///Создание нового элемента. Возвращается указатель на созданый элемент и его индекс.
-    pointer createElement(size_type *index = nullptr);
+    /*! \brief Создание нового элемента. Возвращается указатель на созданый элемент и его индекс.
+    *С optionTrackCommits элемент становится виден через committedSize() только после commit(index),
+    *который вызывается, когда элемент записан. Места освобожденных элементов в этом режиме не используются.
+    */
+    pointer createElement(size_type *index = nullptr) { return emplaceElementImpl<false>(index); }
+
+    /*! \brief Создание нового элемента конструктором T(args...) прямо на месте в блоке.
+    *Если конструктор бросает исключение, место заполняется T(), публикуется, и исключение передается дальше.
+    *С optionTrackCommits элемент публикуется сразу после конструирования, места освобожденных элементов не используются.
+    */
+    template <typename... Args>
+    pointer emplaceElement(Args&&... args) { return emplaceElementImpl<true>(nullptr, std::forward<Args>(args)...); }
+
+    ///Создание нового элемента конструктором T(args...), индекс элемента записывается в index.
+    template <typename... Args>
+    pointer emplaceElementIndexed(size_type &index, Args&&... args) { return emplaceElementImpl<true>(&index, std::forward<Args>(args)...); }
+
+    ///Индекс элемента вместе с поколением места, позволяет обнаружить обращение к освобожденному элементу.
+    struct ElementHandle
+    {
+        ///Индекс элемента
+        size_type index;
+        ///Поколение места на момент создания элемента
+        unsigned int generation;
+    };
+
+    ///Создание нового элемента. Возвращается указатель на созданый элемент, индекс и поколение записываются в handle.
+    pointer createElement(ElementHandle &handle);
+
+    /*! \brief Освобождает элемент. Место элемента попадает в список свободных и будет выдано следующими createElement().
+    *Возвращает false, если элемент уже освобожден или не задан optionRecycle.
+    *Индекс остается в size(), освобожденные элементы пропускаются forEachAlive().
+    */
+    bool destroyElement(size_type index);
+
+    ///Освобождает элемент, если handle не устарел. Возвращает false, если элемент уже освобожден или не задан optionRecycle.
+    bool destroyElement(const ElementHandle &handle);
+
+    ///Возвращает элемент по handle или nullptr, если элемент освобожден. Без optionRecycle элементы не освобождаются.
+    ///После reset() старые handle устаревают, после clear() поколения начинаются заново.
+    pointer find(const ElementHandle &handle);
+
+    ///Жив ли элемент с индексом index.
+    bool isAlive(size_type index) const;
+
+    ///Количество живых элементов: size() без освобожденных.
+    size_t aliveSize() const { return size() - deadCount_.load(); }
+
+    ///Вызывает f(reference, индекс) для каждого живого элемента, освобожденные элементы пропускаются по битовой карте блока.
+    template <typename F>
+    void forEachAlive(F f);
+
+    ///Флаги Options, заданные в конструкторе.
+    unsigned int options() const { return options_; }
+
+    ///Созданный, но еще не опубликованный элемент.
+    struct PendingElement
+    {
+        ///Указатель на элемент
+        pointer ptr;
+        ///Индекс элемента
+        size_type index;
+    };
+
+    /*! \brief Создание нового элемента без публикации, как createElement() с optionTrackCommits.
+    *Элемент становится виден через committedSize() только после commit().
+    *Места освобожденных элементов уже опубликованы, поэтому здесь не используются.
+    */
+    PendingElement createPendingElement();
+
+    ///Публикует записанный элемент. Без optionTrackCommits ничего не делает.
+    void commit(const PendingElement &element) { commit(element.index); }
+
+    ///Публикует записанный элемент с индексом index. Без optionTrackCommits ничего не делает.
+    void commit(size_type index)
+    {
+        if (options_ & optionTrackCommits)
+            commitRange(index, 1);
+    }
+
+    /*! \brief Количество элементов в непрерывном опубликованном начале хранилища.
+    *Все элементы с меньшими индексами полностью записаны, их можно читать одновременно с созданием новых элементов.
+    *Требует optionTrackCommits.
+    */
+    size_type committedSize() const { return committed_.load(std::memory_order_acquire); }
+
+    ///Непрерывный кусок элементов внутри одного блока.
+    struct Span
+    {
+        ///Указатель на первый элемент куска
+        pointer ptr;
+        ///Индекс первого элемента куска
+        size_type index;
+        ///Количество элементов в куске
+        size_type count;
+
+        pointer begin() const { return ptr; }
+        pointer end() const { return ptr + count; }
+    };
+
+    /*! \brief Создание count элементов одной атомарной операцией.
+    *Элементы получают подряд идущие индексы, начиная с индекса первого куска. Места освобожденных элементов не используются.
+    *Диапазон, пересекающий границу блока, возвращается несколькими кусками в порядке возрастания индексов.
+    *С optionTrackCommits каждый кусок публикуется вызовом commit(span) после записи.
+    */
+    std::vector<Span> createElements(size_type count);
+
+    ///Публикует записанный кусок элементов. Без optionTrackCommits ничего не делает.
+    void commit(const Span &span)
+    {
+        if (options_ & optionTrackCommits)
+            commitRange(span.index, span.count);
+    }
+
+    /*! \brief Создание count подряд идущих элементов внутри одного блока, count не больше размера блока.
+    *Если элементы не помещаются в остаток текущего блока, он пропускается и остается в хранилище элементами по умолчанию.
+    *С optionTrackCommits кусок публикуется вызовом commit(span) после записи.
+    */
+    Span createElementsInBlock(unsigned int count);
 
     ///Возвращает элемент по индексу
     reference operator[](size_type index);
@@ -32,322 +478,2266 @@ public:
     ///Возвращает элемент по индексу
     const_reference operator[](size_type index) const;
 
-    ///Реализована ли lock-free семантика
-    bool is_lock_free() const { return curAtomicIndex_.is_lock_free(); }
+    ///Компактная ссылка на элемент, 32 бита.
+    typedef MassHandle<T> Handle;
+
+    ///Создание нового элемента, ссылка на него записывается в handle.
+    template <typename IndexType>
+    pointer createElement(MassHandle<T, IndexType> &handle)
+    {
+        size_type index;
+        pointer result = createElement(&index);
+        handle = MassHandle<T, IndexType>::fromIndex(index);
+        return result;
+    }
+
+    ///Возвращает элемент по непустой ссылке
+    template <typename IndexType>
+    reference operator[](MassHandle<T, IndexType> handle) { return (*this)[handle.index()]; }
+
+    ///Возвращает элемент по непустой ссылке
+    template <typename IndexType>
+    const_reference operator[](MassHandle<T, IndexType> handle) const { return (*this)[handle.index()]; }
+
+    ///Возвращает указатель на элемент по ссылке или nullptr для пустой ссылки
+    template <typename IndexType>
+    pointer get(MassHandle<T, IndexType> handle) { return handle ? &(*this)[handle.index()] : nullptr; }
+
+    ///Расстояние предвыборки по умолчанию для forEachIndex() и gather(), в элементах.
+    static constexpr unsigned int defaultPrefetchDistance = 16;
+    ///Наибольшее расстояние предвыборки.
+    static constexpr unsigned int maxPrefetchDistance = 64;
+
+    /*! \brief Вызывает f(элемент, индекс) для элементов с индексами из indices в порядке перечисления.
+    *Адрес элемента вычисляется за prefetchDistance элементов до вызова f, и его строки кэша заранее запрашиваются
+    *у памяти, поэтому промахи кэша при произвольном доступе перекрываются. Индексы не проверяются, как в operator[].
+    */
+    template <typename Indices, typename F>
+    void forEachIndex(const Indices &indices, F f, unsigned int prefetchDistance = defaultPrefetchDistance);
+    ///То же для константного хранилища, f получает const_reference.
+    template <typename Indices, typename F>
+    void forEachIndex(const Indices &indices, F f, unsigned int prefetchDistance = defaultPrefetchDistance) const;
+
+    ///Копирует элементы с индексами из indices в out с предвыборкой, как forEachIndex(). Возвращает конец записанного.
+    template <typename Indices, typename OutputIt>
+    OutputIt gather(const Indices &indices, OutputIt out, unsigned int prefetchDistance = defaultPrefetchDistance) const;
+
+    ///Реализована ли lock-free семантика
+    bool is_lock_free() const { return curAtomicIndex_.is_lock_free(); }
+
+    ///Возвращает статистику выделения. Без MASS_ALLOCATOR_STATS все поля нулевые.
+    MassAllocatorStats stats() const;
+
+    /*! \brief Локальный кэш выделения для одного потока.
+    *Захватывает сразу chunkSize элементов одной атомарной операцией и раздает их без обращения к общему счетчику.
+    *Неиспользованный остаток при flush() по возможности возвращается хранилищу, иначе остается
+    *в хранилище инициализированными нулями элементами и учитывается в size() и итераторами.
+    *С optionTrackCommits выданные элементы публикуются пакетом: при захвате следующей порции, commit() и flush().
+    *Поэтому к следующему вызову createElement() поток должен закончить запись ранее выданных элементов.
+    *Захваченные и еще не выданные места не сконструированы, поэтому кэш сбрасывается или разрушается
+    *до clear(), reset(), detach() и clearAsync() хранилища.
+    */
+    class ThreadCache
+    {
+    public:
+        ///Конструктор. chunkSize ограничивается размером блока.
+        explicit ThreadCache(MassAllocator &allocator, unsigned int chunkSize = 1024);
+        ///Деструктор. Возвращает неиспользованный остаток.
+        ~ThreadCache();
+
+        ///Создание нового элемента из локального запаса. Возвращается указатель на созданый элемент и его индекс.
+        pointer createElement(size_type *index = nullptr);
+
+        ///Публикует все выданные кэшем элементы. Без optionTrackCommits ничего не делает.
+        void commit();
+
+        ///Публикует выданные элементы и возвращает хранилищу неиспользованный остаток, если после нас никто не захватывал элементы.
+        void flush();
+    private:
+        //Запрет копирования
+        ThreadCache(const ThreadCache &);
+        ThreadCache& operator=(const ThreadCache &);
+
+        ///Захватывает у хранилища новую порцию элементов.
+        void refill();
+
+        MassAllocator *allocator_;
+        unsigned int chunkSize_;
+        ///Текущий кусок, из которого раздаются элементы.
+        pointer current_;
+        pointer end_;
+        size_type currentIndex_;
+        ///Первый выданный и еще не опубликованный элемент текущего куска.
+        size_type publishedIndex_;
+        ///Порция может пересекать границу блока, тогда ее вторая часть ждет здесь.
+        Span next_;
+        bool hasNext_;
+    };
+
+    ///Итератор для хранилища.
+    class Iterator
+    {
+    public:
+        typedef typename std::random_access_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef size_t difference_type;
+        typedef T* pointer;
+        typedef T& reference;
+
+        ///Перемещает итератор на следующий элемент хранилища
+        Iterator& operator++();
+        Iterator operator++(int);
+
+        ///Перемещает итератор на предыдущий элемент хранилища
+        Iterator& operator--();
+        Iterator operator--(int);
+
+        difference_type operator-(const Iterator &rh) const;
+        Iterator operator-(difference_type offset) const;
+
+        Iterator operator+(difference_type offset) const;
+
+        ///Возвращает указатель на элемент, на котором находится итератор
+        pointer operator->();
+
+        ///Возвращает ссылку на элемент, на котором находится итератор
+        reference operator*();
+
+        ///Равенство итераторов
+        bool operator==(const Iterator &rh) const;
+
+        ///Сравнение итераторов на меньше
+        bool operator<(const Iterator &rh) const;
+
+        ///Неравенство итераторов
+        bool operator!=(const Iterator &rh) const;
+
+        ///Возвращает индекс элемента, на котором находится итератор
+        size_type getIndex() const;
+    private:
+        friend class MassAllocator;
+        MassAllocator *MassAllocator_;
+        size_type index_;
+    };
+
+    ///Возвращает итератор на начало хранилища
+    Iterator begin();
+
+    ///Возвращает итератор на конец хранилища
+    Iterator end();
+
+    /*! \brief Итератор, перемещающийся по указателю внутри блока.
+    *Номер блока пересчитывается только при переходе на следующий блок, поэтому проход не требует
+    *деления и обращения к каталогу блоков на каждом элементе.
+    */
+    class SegmentedIterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef ptrdiff_t difference_type;
+        typedef T* pointer;
+        typedef T& reference;
+
+        ///Перемещает итератор на следующий элемент хранилища
+        SegmentedIterator& operator++()
+        {
+            if (++ptr_ == blockEnd_ && blockIndx_ + 1 < blocksCount_)
+                setBlock(blockIndx_ + 1);
+            return *this;
+        }
+        SegmentedIterator operator++(int)
+        {
+            SegmentedIterator result(*this);
+            ++*this;
+            return result;
+        }
+
+        ///Возвращает указатель на элемент, на котором находится итератор
+        pointer operator->() const { return ptr_; }
+
+        ///Возвращает ссылку на элемент, на котором находится итератор
+        reference operator*() const { return *ptr_; }
+
+        ///Равенство итераторов. Конец одного блока может совпасть по адресу с началом другого, поэтому сравнивается и номер блока.
+        bool operator==(const SegmentedIterator &rh) const { return ptr_ == rh.ptr_ && blockIndx_ == rh.blockIndx_; }
+
+        ///Неравенство итераторов
+        bool operator!=(const SegmentedIterator &rh) const { return !(*this == rh); }
+    private:
+        friend class MassAllocator;
+
+        ///Переходит на начало блока.
+        void setBlock(size_type blockIndx);
+
+        MassAllocator *MassAllocator_;
+        pointer ptr_;
+        pointer blockEnd_;
+        size_type blockIndx_;
+        size_type blocksCount_;
+        size_type size_;
+    };
+
+    ///Возвращает поблочный итератор на начало хранилища
+    SegmentedIterator segmentedBegin();
+
+    ///Возвращает поблочный итератор на конец хранилища
+    SegmentedIterator segmentedEnd();
+
+    ///Вызывает f(pointer, количество) для непрерывного куска элементов каждого блока.
+    template <typename F>
+    void forEachBlock(F f) { forEachBlockUpTo(size(), f); }
+
+    ///Возвращает итератор на конец опубликованного начала хранилища.
+    Iterator committedEnd();
+
+    ///Вызывает f(pointer, количество) для опубликованных элементов каждого блока.
+    template <typename F>
+    void forEachCommittedBlock(F f) { forEachBlockUpTo(committedSize(), f); }
+
+    ///Возвращает непрерывные куски элементов всех блоков.
+    ///С optionRecycle куски включают места освобожденных элементов, живые элементы куска перебирает forEachAlive(span, f).
+    std::vector<Span> segments();
+
+    ///Вызывает f(reference, индекс) для живых элементов куска span, полученного из segments(), или его части.
+    template <typename F>
+    void forEachAlive(const Span &span, F f);
+
+    ///Kоличество элементов
+    size_t size() const;
+
+    /*! \brief Очищает хранилище, сбрасывает индекс. В файловом режиме блоки и файл закрываются, содержимое файла не меняется.
+    *Деструкторы вызываются для всех мест до size(), поэтому все ThreadCache хранилища к этому моменту
+    *должны быть сброшены flush() или разрушены: захваченные ими и не выданные места еще не сконструированы.
+    */
+    void clear();
+
+    /*! \brief Переносит все элементы, блоки и файл хранилища в новое хранилище, а это оставляет пустым, как после clear().
+    *Перенос не зависит от количества блоков. Возвращенное хранилище имеет тот же размер блока и опции, кроме
+    *optionBackgroundRefill, и пригодно для чтения и дальнейшего заполнения. Деструкторы элементов вызываются при его очистке.
+    *Нельзя вызывать одновременно с созданием элементов. Как и перед clear(), все ThreadCache должны быть сброшены или разрушены.
+    */
+    std::unique_ptr<MassAllocator> detach();
+
+    /*! \brief Очищает хранилище, освобождая блоки в фоновом потоке.
+    *Хранилище пусто и готово к заполнению сразу после возврата, блоки предыдущего заполнения вместе с деструкторами
+    *элементов освобождаются фоновым потоком на threadsCount потоках (0 - по количеству аппаратных потоков).
+    *Деструктор хранилища дожидается окончания фонового освобождения. Нельзя вызывать одновременно с созданием элементов.
+    */
+    void clearAsync(unsigned int threadsCount = 1);
+
+    ///Дожидается окончания освобождения, начатого clearAsync().
+    void waitClearAsync();
+
+    ///Когда обнулять элементы блоков, сохраненных при reset().
+    enum ZeroPolicy
+    {
+        ///Обнулить все использованные блоки сразу в reset().
+        zeroEager,
+        ///Обнулять блок при его повторном использовании.
+        zeroLazy,
+        ///Не обнулять. Новые элементы могут содержать данные предыдущего заполнения.
+        zeroNone
+    };
+
+    /*! \brief Сбрасывает индекс, сохраняя выделенные блоки для следующего заполнения.
+    *Блоки сверх необходимых для keepElements элементов возвращаются системе: блоки mmap через madvise(MADV_DONTNEED)
+    *(они остаются в хранилище, учитываются в memUse() и при повторном использовании читаются нулями), остальные освобождаются.
+    *Нельзя вызывать одновременно с созданием элементов. Как и перед clear(), все ThreadCache должны быть сброшены или разрушены.
+    */
+    void reset(ZeroPolicy zeroPolicy = zeroLazy, size_type keepElements = (size_type)-1);
+
+    /*! \brief Заранее создает блоки для первых count элементов.
+    *Создание элементов в этих блоках не будет останавливаться на выделении памяти.
+    *Если prefault, то страницы блоков, полученных через mmap без optionPopulate, сразу отображаются в память.
+    *Можно вызывать одновременно с созданием элементов.
+    */
+    void reserve(size_type count, bool prefault = false);
+
+    /*! \brief Задает порог подготовки следующего блока.
+    *Поток, получивший элемент с индексом threshold в блоке, заранее создает (или обнуляет) следующий блок,
+    *и переход на новый блок не останавливает другие потоки. С optionBackgroundRefill это делает фоновый поток.
+    *Значение не меньше размера блока отключает подготовку. По умолчанию 3/4 блока.
+    */
+    void setPrepareThreshold(unsigned int threshold) { prepareThreshold_.store(threshold, std::memory_order_relaxed); }
+
+#ifdef __linux__
+    /*! \brief Переводит пустое хранилище в файловый режим: блоки отображаются из файла path через mmap.
+    *Файл создается заново. Элементы записываются прямо в страницы файла, save() сбрасывает их на диск.
+    *Тип T должен быть тривиально копируемым. Ошибки сообщаются исключением std::system_error.
+    */
+    void createFile(const std::string &path);
+
+    ///Режим открытия файла хранилища.
+    enum FileMode
+    {
+        ///Чтение и дальнейшее создание элементов.
+        fileReadWrite,
+        ///Общее отображение только для чтения, несколько процессов разделяют страницы через кэш страниц.
+        ///Создание элементов, reset() и save() в этом режиме не допускаются и бросают std::system_error
+        ///с errc::read_only_file_system.
+        fileReadOnly
+    };
+
+    /*! \brief Открывает файл, записанный save(), без десериализации: все блоки отображаются одним вызовом mmap.
+    *Текущее содержимое хранилища удаляется. Размер блока, размер и отпечаток типа элемента должны совпадать
+    *с записанными в заголовке, иначе бросается std::system_error с errc::invalid_argument.
+    *Освобожденные через destroyElement() элементы после открытия снова считаются живыми.
+    */
+    void open(const std::string &path, FileMode mode = fileReadWrite);
+
+    ///Сбрасывает блоки на диск и записывает в заголовок количество элементов.
+    void save();
+#endif
+
+    ///Открыто ли хранилище в файловом режиме.
+    bool isFileBacked() const { return fileFd_ >= 0; }
+
+    /*! \brief Возвращает потребление памяти: размер всех блоков хранилища.
+    *Блоки mmap, страницы которых reset() вернул системе через madvise(MADV_DONTNEED), остаются в хранилище
+    *и продолжают учитываться, хотя до повторного использования не занимают физической памяти.
+    */
+    size_t memUse() const;
+private:
+    //Запрет копирования
+    MassAllocator(const MassAllocator &);
+    MassAllocator& operator=(const MassAllocator &);
+
+    ///Количество элементов в блоке.
+    unsigned int elementsInBlockCount_;
+    ///Флаги Options.
+    unsigned int options_;
+
+    ///Количество элементов в блоке, константа для размера блока, заданного на этапе компиляции.
+    unsigned int elementsInBlock() const
+    {
+        if constexpr (BlockShift != 0)
+            return 1u << BlockShift;
+        else
+            return elementsInBlockCount_;
+    }
+
+    ///Номер блока по сквозному индексу элемента.
+    size_type blockOf(size_type index) const
+    {
+        if constexpr (BlockShift != 0)
+            return index >> BlockShift;
+        else
+            return index / elementsInBlockCount_;
+    }
+
+    ///Индекс элемента в блоке по сквозному индексу элемента.
+    size_type offsetInBlock(size_type index) const
+    {
+        if constexpr (BlockShift != 0)
+            return index & ((1u << BlockShift) - 1);
+        else
+            return index % elementsInBlockCount_;
+    }
+    ///Блоки с элементами.
+    MassBlockDirectory<T> blocks_;
+    ///Количество выделенных блоков, включая блоки mmap, страницы которых возвращены системе в reset().
+    std::atomic<unsigned int> blocksCount_;
+    ///Блоки с номерами меньше dirtyBlocks_ могут содержать данные предыдущего заполнения.
+    std::atomic<unsigned int> dirtyBlocks_;
+    ///В текущем заполнении все блоки с номерами меньше zeroedBlocks_ уже обнулены.
+    std::atomic<unsigned int> zeroedBlocks_;
+    ///Защищает обнуление блока от одновременного выполнения в двух потоках.
+    std::mutex zeroMutex_;
+
+    ///Индекс элемента в блоке, при захвате которого готовится следующий блок.
+    ///Читается создающими элементы потоками, поэтому атомарный.
+    std::atomic<unsigned int> prepareThreshold_;
+    ///Фоновый поток подготовки блоков.
+    std::thread refillThread_;
+    ///Номер блока, который должен подготовить фоновый поток, или noBlock.
+    std::atomic<unsigned int> refillRequest_;
+    ///Признак остановки фонового потока.
+    std::atomic<bool> refillStop_;
+    ///Не дает очистке хранилища пересечься с подготовкой блока в фоновом потоке.
+    std::mutex refillMutex_;
+
+#ifdef MASS_ALLOCATOR_STATS
+    ///Счетчик элементов, захваченных одним потоком. Пишет в него только этот поток.
+    struct ThreadCounter
+    {
+        std::thread::id thread;
+        std::atomic<uint64_t> allocations;
+    };
+
+    ///Счетчики статистики.
+    struct Counters
+    {
+        std::atomic<uint64_t> blocksAllocated;
+        std::atomic<uint64_t> blocksDiscarded;
+        std::atomic<uint64_t> blocksZeroed;
+        std::atomic<uint64_t> blockAllocationNs;
+        std::atomic<uint64_t> waitIterations;
+        std::atomic<uint64_t> waitNs;
+        std::atomic<uint64_t> cacheSlotsReturned;
+        std::atomic<uint64_t> cacheSlotsAbandoned;
+    };
+    Counters counters_;
+    ///Уникальный номер хранилища, по которому поток находит свой счетчик.
+    uint64_t statsId_;
+    ///Счетчики потоков. Адреса элементов списка не меняются.
+    std::list<ThreadCounter> threadCounters_;
+    mutable std::mutex threadCountersMutex_;
+
+    ///Возвращает счетчик текущего потока.
+    ThreadCounter& threadCounter();
+
+    ///Учитывает count элементов, захваченных текущим потоком.
+    void countAllocations(unsigned int count)
+    {
+        auto &counter = threadCounter().allocations;
+        counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
+
+    ///Наносекунды, прошедшие с момента start.
+    static uint64_t elapsedNs(std::chrono::steady_clock::time_point start)
+    {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+#endif
+
+    ///Сквозной индекс для захвата следующего свободного элемента.
+    ///Cтаршие 32 бита это индекс блока, а нижние 32 бита - индекс элемента в блоке.
+    std::atomic<uint64_t> curAtomicIndex_;
+
+    ///Битовые карты опубликованных элементов блоков (optionTrackCommits).
+    MassBlockDirectory<std::atomic<uint64_t>> commitBits_;
+    ///Количество элементов в непрерывном опубликованном начале хранилища.
+    std::atomic<size_type> committed_;
+
+    ///Захват места под новый элемент без конструирования и публикации. Reuse разрешает брать места освобожденных элементов.
+    ///В generation записывается поколение места на момент захвата.
+    template <bool Reuse>
+    pointer createElementImpl(size_type *index, unsigned int *generation = nullptr);
+
+    ///Захват места и конструирование нового элемента. Publish - публиковать элемент сразу после конструирования.
+    template <bool Publish, typename... Args>
+    pointer emplaceElementImpl(size_type *index, Args&&... args);
+
+    ///Конструирует элемент на месте. Элемент без аргументов тривиального типа остается заполненным нулями.
+    template <typename... Args>
+    static void constructElement(pointer ptr, Args&&... args);
+
+    ///Конструирует count элементов по умолчанию.
+    static void constructElements(pointer ptr, size_type count);
+
+    ///Вызывает деструкторы всех живых элементов, параллельно по блокам.
+    void destroyElements();
+
+    ///Оставляет в хранилище захваченные, но не выданные элементы: конструирует их по умолчанию и публикует.
+    void abandon(pointer ptr, size_type firstIndex, size_type count)
+    {
+        constructElements(ptr, count);
+        if (options_ & optionTrackCommits)
+            commitRange(firstIndex, count);
+    }
+
+    ///Отмечает элементы опубликованными и продвигает границу опубликованного начала.
+    void commitRange(size_type first, size_type count);
+
+    ///Количество подряд опубликованных элементов, начиная с индекса first.
+    size_type committedRun(size_type first) const;
+
+    ///Количество 64-битных слов в битовой карте блока.
+    unsigned int bitWords() const { return (elementsInBlock() + 63) / 64; }
+
+    ///Создает служебный массив блока из count нулевых значений, если его еще нет.
+    template <typename U>
+    static void ensureBlockData(MassBlockDirectory<U> &directory, unsigned int blockIndx, unsigned int count);
+
+    ///Освобождает служебный массив блока.
+    template <typename U>
+    static void releaseBlockData(MassBlockDirectory<U> &directory, unsigned int blockIndx);
+
+    ///Состояние места элемента для повторного использования (optionRecycle).
+    struct SlotState
+    {
+        ///Поколение места. Четное значение - элемент жив, нечетное - освобожден.
+        std::atomic<unsigned int> generation;
+        ///Следующее место в списке свободных в формате freeHead_.
+        std::atomic<uint64_t> next;
+    };
+
+    ///Состояния мест элементов блоков.
+    MassBlockDirectory<SlotState> slotStates_;
+    ///Битовые карты освобожденных элементов блоков.
+    MassBlockDirectory<std::atomic<uint64_t>> deadBits_;
+    /*! \brief Вершина списка свободных мест.
+    *Младшие freeIndexBits бит - индекс места плюс один (0 - список пуст),
+    *старшие биты - счетчик изменений вершины, который защищает от ABA.
+    */
+    std::atomic<uint64_t> freeHead_;
+    ///Количество освобожденных и еще не использованных повторно элементов.
+    std::atomic<size_type> deadCount_;
+
+    static const unsigned int freeIndexBits = 40;
+    static const uint64_t freeIndexMask = (1ull << freeIndexBits) - 1;
+
+    ///Состояние места элемента.
+    SlotState& slotState(size_type index) const { return slotStates_[(unsigned int)blockOf(index)][offsetInBlock(index)]; }
+
+    ///Поколение места элемента, без optionRecycle всегда 0.
+    unsigned int slotGeneration(size_type index) const
+    {
+        return (options_ & optionRecycle) ? slotState(index).generation.load(std::memory_order_acquire) : 0;
+    }
+
+    ///Берет место из списка свободных. Возвращает nullptr, если список пуст. В generation записывается новое поколение места.
+    pointer reuseElement(size_type *index, unsigned int *generation = nullptr);
+
+    ///Освобождает блок и его служебные данные.
+    void releaseBlock(unsigned int blockIndx);
+
+    ///Запрашивает строки кэша элемента без ожидания.
+    static void prefetchElement(const T *ptr)
+    {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_prefetch((const char*)ptr, _MM_HINT_T0);
+        if constexpr (sizeof(T) > 64)
+            _mm_prefetch((const char*)ptr + sizeof(T) - 1, _MM_HINT_T0);
+#elif defined(__GNUC__)
+        __builtin_prefetch(ptr);
+        if constexpr (sizeof(T) > 64)
+            __builtin_prefetch((const char*)ptr + sizeof(T) - 1);
+#else
+        (void)ptr;
+#endif
+    }
+
+    ///Общая реализация forEachIndex() для константного и неконстантного хранилища.
+    template <typename Self, typename Indices, typename F>
+    static void forEachIndexImpl(Self &self, const Indices &indices, F &f, unsigned int prefetchDistance);
+
+    ///Очистка хранилища, блоки освобождаются на threadsCount потоках.
+    void clearImpl(unsigned int threadsCount);
+
+    ///Поток фонового освобождения блоков после clearAsync().
+    std::thread releaseThread_;
+
+    ///Вызывает f(pointer, количество) для кусков блоков с элементами до индекса count.
+    template <typename F>
+    void forEachBlockUpTo(size_type count, F f);
+
+    ///Номер блока в сквозном индексе до выделения первого блока.
+    static const unsigned int noBlock = 0xffffffff;
+
+    ///Задает значение сквозного индекс по номеру блока и индексу в блоке.
+    void setIndex(unsigned int blockIndx, unsigned int itemIndex);
+
+    ///Захватывает count подряд идущих элементов одной атомарной операцией.
+    ///Для каждого непрерывного куска внутри блока вызывается f(pointer, индекс первого элемента, количество).
+    ///Если inOneBlock, то диапазон не делится: остаток блока, в который он не поместился, пропускается.
+    ///Элементы нетривиального типа конструируются по умолчанию до вызова f, публикует их вызывающий.
+    template <typename F>
+    void claim(unsigned int count, F f, bool inOneBlock = false);
+
+    ///Захват без конструирования элементов.
+    template <typename F>
+    void claimImpl(unsigned int count, F &f, bool inOneBlock = false);
+
+    ///Медленный путь захвата: выделение новых блоков или ожидание, пока их выделит другой поток.
+    template <typename F>
+    void claimSlow(uint64_t index, unsigned int count, F f, bool inOneBlock = false);
+
+    /*! \brief Наибольшее количество элементов, захватываемых одной атомарной операцией.
+    *Пока блок сменяется, младшие 32 бита сквозного индекса превышают размер блока на захваты, сделанные после его конца.
+    *Диапазоны больше maxFetchAddCount захватываются через CAS только вне смены блока, поэтому превышение не больше
+    *maxClaimCount от захвата, начавшего смену, плюс maxFetchAddCount на каждый поток. С размером блока не больше
+    *maxBlockSize младшие 32 бита не переполняются, пока одновременно захватывают меньше 2^15 потоков.
+    */
+    static const unsigned int maxClaimCount = 1u << 30;
+    ///Наибольшее количество элементов, захватываемых через fetch_add без проверки смены блока.
+    static const unsigned int maxFetchAddCount = 1u << 16;
+
+    ///Захватывает count элементов через CAS, дожидаясь окончания смены блока. Возвращает прежнее значение сквозного индекса.
+    uint64_t claimLarge(unsigned int count);
+
+    ///Выделяет новый блок, инициализированный нулями.
+    T* allocateBlock(unsigned int blockIndx);
+
+    ///Освобождает блок.
+    void freeBlock(T *block);
+
+    ///Размер блока в байтах.
+    size_t blockBytes() const { return (size_t)elementsInBlock() * sizeof(T); }
+
+    ///Возвращает блок, готовый к заполнению: создает его или обнуляет, если он остался от предыдущего заполнения.
+    T* acquireBlock(unsigned int blockIndx);
+
+    ///Заранее готовит блок к заполнению в этом или в фоновом потоке.
+    void prepareBlock(unsigned int blockIndx);
+
+    ///Готовит следующий блок, если захваченный диапазон в блоке содержит порог подготовки.
+    void prepareIfCrossed(unsigned int blockIndx, unsigned int itemIndex, unsigned int count)
+    {
+        unsigned int threshold = prepareThreshold_.load(std::memory_order_relaxed);
+        if (itemIndex <= threshold && threshold - itemIndex < count)
+            prepareBlock(blockIndx + 1);
+    }
+
+    ///Цикл фонового потока подготовки блоков.
+    void refillLoop();
+
+    ///Останавливает фоновый поток подготовки блоков.
+    void stopRefill();
+
+    ///Возвращает блок с заданным номером, создавая его, если он еще не создан.
+    ///Если prefault, то страницы нового блока отображаются в память до того, как блок станет виден другим потокам.
+    T* ensureBlock(unsigned int blockIndx, bool prefault = false);
+
+    ///Создает служебные данные блока, нужные включенным опциям.
+    void ensureBlockState(unsigned int blockIndx);
+
+    ///Дескриптор файла хранилища, -1 вне файлового режима.
+    int fileFd_;
+    ///Файл открыт только для чтения.
+    bool fileReadOnly_;
+    ///Текущий размер файла.
+    size_t fileSize_;
+    ///Защищает увеличение файла.
+    std::mutex fileMutex_;
+
+#ifdef __linux__
+    ///Размер заголовка файла: одна страница.
+    static size_t fileHeaderSize() { return std::max<size_t>((size_t)sysconf(_SC_PAGESIZE), sizeof(MassAllocatorFileHeader)); }
+
+    ///Расстояние между блоками в файле: размер блока, округленный до страницы.
+    size_t fileBlockStride() const
+    {
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        return (blockBytes() + pageSize - 1) & ~(pageSize - 1);
+    }
+
+    ///Отображает блок blockIndx из файла, при необходимости увеличивая файл.
+    T* mapFileBlock(unsigned int blockIndx);
+
+    ///Записывает заголовок файла с количеством элементов count.
+    void writeFileHeader(uint64_t count);
+
+    ///Обрезает файл до заголовка и blocksCount блоков.
+    void truncateFile(size_t blocksCount);
+#endif
+
+    ///Закрывает файл хранилища.
+    void closeFile();
+
+    ///Бросает std::system_error с errc::read_only_file_system, если файл открыт только для чтения.
+    void checkWritable() const
+    {
+        if (fileReadOnly_)
+            throw std::system_error(std::make_error_code(std::errc::read_only_file_system), "MassAllocator: new element in a read-only file");
+    }
+
+    ///Отпечаток типа элемента для заголовка файла: имя типа, размер и выравнивание.
+    static uint64_t typeFingerprint();
+};
+
+template <typename T, unsigned int BlockShift>
+MassAllocator<T, BlockShift>::MassAllocator(unsigned int blockSize, unsigned int options)
+    : elementsInBlockCount_(BlockShift != 0 ? 1u << BlockShift : blockSize)
+    , options_(options)
+    , blocksCount_(0)
+    , dirtyBlocks_(0)
+    , zeroedBlocks_(0)
+    , prepareThreshold_(elementsInBlock() - elementsInBlock() / 4)
+    , refillRequest_(noBlock)
+    , refillStop_(false)
+    , committed_(0)
+    , freeHead_(0)
+    , deadCount_(0)
+    , fileFd_(-1)
+    , fileReadOnly_(false)
+    , fileSize_(0)
+{
+    if (elementsInBlock() == 0 || elementsInBlock() > maxBlockSize)
+        throw std::bad_alloc();
+#ifdef MASS_ALLOCATOR_STATS
+    static std::atomic<uint64_t> nextStatsId(1);
+    statsId_ = nextStatsId++;
+    counters_.blocksAllocated = 0;
+    counters_.blocksDiscarded = 0;
+    counters_.blocksZeroed = 0;
+    counters_.blockAllocationNs = 0;
+    counters_.waitIterations = 0;
+    counters_.waitNs = 0;
+    counters_.cacheSlotsReturned = 0;
+    counters_.cacheSlotsAbandoned = 0;
+#endif
+    //задаем значение сквозного индекса таким, чтобы первое выделение элемента привело к распределению нового блока
+    setIndex(noBlock, elementsInBlock());
+    if (options_ & optionBackgroundRefill)
+        refillThread_ = std::thread([this] { refillLoop(); });
+}
+
+template <typename T, unsigned int BlockShift>
+MassAllocator<T, BlockShift>::~MassAllocator()
+{
+    stopRefill();
+    clear();
+    waitClearAsync();
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::setIndex(unsigned int blockIndx, unsigned int itemIndex)
+{
+    auto a = (((uint64_t)blockIndx) << 32) + itemIndex;
+    curAtomicIndex_.store(a);
+}
+
+template <typename T, unsigned int BlockShift>
+template <bool Publish, typename... Args>
+typename MassAllocator<T, BlockShift>::pointer MassAllocator<T, BlockShift>::emplaceElementImpl(size_type *returningIndex, Args&&... args)
+{
+    size_type index;
+    //места освобожденных элементов лежат ниже границы публикации и видны читателям во время конструирования,
+    //поэтому с optionTrackCommits элемент всегда берется новым и публикуется явно
+    pointer result = (options_ & optionTrackCommits) ? createElementImpl<false>(&index) : createElementImpl<true>(&index);
+    try
+    {
+        constructElement(result, std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        //в месте остался элемент T(), неопубликованное место навсегда остановило бы границу публикации
+        if (options_ & optionTrackCommits)
+            commitRange(index, 1);
+        throw;
+    }
+    //элемент публикуется только после конструирования
+    if (Publish && (options_ & optionTrackCommits))
+        commitRange(index, 1);
+    if (returningIndex != nullptr)
+        *returningIndex = index;
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+template <typename... Args>
+void MassAllocator<T, BlockShift>::constructElement(pointer ptr, Args&&... args)
+{
+    if constexpr (sizeof...(Args) == 0 && std::is_trivially_default_constructible_v<T>)
+    {
+        //память блока уже заполнена нулями
+        (void)ptr;
+    }
+    else if constexpr (std::is_nothrow_constructible_v<T, Args&&...>)
+    {
+        new (ptr) T(std::forward<Args>(args)...);
+    }
+    else
+    {
+        static_assert(std::is_nothrow_default_constructible_v<T>, "T() must not throw: a claimed slot always holds a live element");
+        try
+        {
+            new (ptr) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            //место уже учтено в size(), поэтому в нем должен остаться живой элемент
+            new (ptr) T();
+            throw;
+        }
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::constructElements(pointer ptr, size_type count)
+{
+    if constexpr (!std::is_trivially_default_constructible_v<T>)
+    {
+        static_assert(std::is_nothrow_default_constructible_v<T>, "T() must not throw: a claimed slot always holds a live element");
+        for (size_type i = 0; i < count; ++i)
+            new (ptr + i) T();
+    }
+    else
+    {
+        (void)ptr;
+        (void)count;
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::destroyElements()
+{
+    if constexpr (!std::is_trivially_destructible_v<T>)
+    {
+        auto spans = segments();
+        massParallelFor(spans.size(),
+            [&](size_t spanIndx)
+            {
+                auto &span = spans[spanIndx];
+                //освобожденные элементы уже разрушены в destroyElement()
+                std::atomic<uint64_t> *dead = (options_ & optionRecycle) ? deadBits_.find((unsigned int)blockOf(span.index)) : nullptr;
+                for (size_type i = 0; i < span.count; ++i)
+                {
+                    if (dead == nullptr || !((dead[i >> 6].load(std::memory_order_relaxed) >> (i & 63)) & 1))
+                        span.ptr[i].~T();
+                }
+            });
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::pointer MassAllocator<T, BlockShift>::createElement(ElementHandle &handle)
+{
+    //поколение запоминается при захвате места: после него элемент уже могут освободить по индексу
+    unsigned int generation = 0;
+    pointer result = (options_ & optionTrackCommits) ? createElementImpl<false>(&handle.index, &generation) : createElementImpl<true>(&handle.index, &generation);
+    constructElement(result);
+    handle.generation = generation;
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::pointer MassAllocator<T, BlockShift>::reuseElement(size_type *returningIndex, unsigned int *generation)
+{
+    uint64_t head = freeHead_.load();
+    size_type index;
+    for (;;)
+    {
+        uint64_t slot = head & freeIndexMask;
+        if (slot == 0)
+            return nullptr;
+        index = slot - 1;
+        //место не может быть освобождено повторно, пока лежит в списке, поэтому next не меняется;
+        //если вершину успели снять и вернуть, счетчик вершины отличается и CAS не пройдет
+        uint64_t next = slotState(index).next.load();
+        uint64_t desired = ((head & ~freeIndexMask) + (1ull << freeIndexBits)) | next;
+        if (freeHead_.compare_exchange_weak(head, desired))
+            break;
+    }
+    deadCount_.fetch_sub(1);
+    unsigned int item = (unsigned int)offsetInBlock(index);
+    deadBits_[(unsigned int)blockOf(index)][item >> 6].fetch_and(~(1ull << (item & 63)));
+    pointer result = &(*this)[index];
+    //элемент нетривиального типа будет сконструирован заново
+    if constexpr (std::is_trivially_default_constructible_v<T>)
+        memset((void*)result, 0, sizeof(T));
+    //новое четное поколение делает элемент живым
+    unsigned int newGeneration = slotState(index).generation.fetch_add(1, std::memory_order_release) + 1;
+    if (generation != nullptr)
+        *generation = newGeneration;
+    if (returningIndex != nullptr)
+        *returningIndex = index;
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+bool MassAllocator<T, BlockShift>::destroyElement(size_type index)
+{
+    if (!(options_ & optionRecycle) || index >= size())
+        return false;
+    unsigned int generation = slotState(index).generation.load();
+    if (generation & 1)
+        return false;
+    ElementHandle handle = { index, generation };
+    return destroyElement(handle);
+}
+
+template <typename T, unsigned int BlockShift>
+bool MassAllocator<T, BlockShift>::destroyElement(const ElementHandle &handle)
+{
+    if (!(options_ & optionRecycle) || handle.index >= size() || (handle.generation & 1))
+        return false;
+    if (handle.index >= freeIndexMask)
+        throw std::bad_alloc();
+    SlotState &state = slotState(handle.index);
+    //владельцем освобождения становится поток, сделавший поколение нечетным
+    unsigned int expected = handle.generation;
+    if (!state.generation.compare_exchange_strong(expected, handle.generation + 1))
+        return false;
+    if constexpr (!std::is_trivially_destructible_v<T>)
+        (*this)[handle.index].~T();
+    unsigned int item = (unsigned int)offsetInBlock(handle.index);
+    deadBits_[(unsigned int)blockOf(handle.index)][item >> 6].fetch_or(1ull << (item & 63));
+    //неопубликованный элемент не должен задерживать границу публикации
+    if (options_ & optionTrackCommits)
+        commitRange(handle.index, 1);
+    deadCount_.fetch_add(1);
+
+    uint64_t head = freeHead_.load();
+    for (;;)
+    {
+        state.next.store(head & freeIndexMask);
+        uint64_t desired = ((head & ~freeIndexMask) + (1ull << freeIndexBits)) | (handle.index + 1);
+        if (freeHead_.compare_exchange_weak(head, desired))
+            return true;
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::pointer MassAllocator<T, BlockShift>::find(const ElementHandle &handle)
+{
+    if (handle.index >= size())
+        return nullptr;
+    if ((options_ & optionRecycle) && slotState(handle.index).generation.load(std::memory_order_acquire) != handle.generation)
+        return nullptr;
+    return &(*this)[handle.index];
+}
+
+template <typename T, unsigned int BlockShift>
+bool MassAllocator<T, BlockShift>::isAlive(size_type index) const
+{
+    if (index >= size())
+        return false;
+    return !(options_ & optionRecycle) || !(slotState(index).generation.load(std::memory_order_acquire) & 1);
+}
+
+template <typename T, unsigned int BlockShift>
+template <typename F>
+void MassAllocator<T, BlockShift>::forEachAlive(F f)
+{
+    size_type first = 0;
+    unsigned int blockIndx = 0;
+    forEachBlockUpTo(size(),
+        [&](pointer ptr, size_type count)
+        {
+            std::atomic<uint64_t> *dead = (options_ & optionRecycle) ? deadBits_[blockIndx] : nullptr;
+            for (size_type word = 0; word * 64 < count; ++word)
+            {
+                //живые элементы слова перебираются по установленным битам
+                size_type wordCount = std::min<size_type>(64, count - word * 64);
+                uint64_t alive = wordCount == 64 ? ~0ull : (1ull << wordCount) - 1;
+                if (dead != nullptr)
+                    alive &= ~dead[word].load(std::memory_order_acquire);
+                while (alive != 0)
+                {
+                    size_type item = word * 64 + std::countr_zero(alive);
+                    alive &= alive - 1;
+                    f(ptr[item], first + item);
+                }
+            }
+            first += count;
+            ++blockIndx;
+        });
+}
+
+template <typename T, unsigned int BlockShift>
+template <typename F>
+void MassAllocator<T, BlockShift>::forEachAlive(const Span &span, F f)
+{
+    std::atomic<uint64_t> *dead = (options_ & optionRecycle) ? deadBits_.find((unsigned int)blockOf(span.index)) : nullptr;
+    if (dead == nullptr)
+    {
+        for (size_type i = 0; i < span.count; ++i)
+            f(span.ptr[i], span.index + i);
+        return;
+    }
+    //кусок может начинаться не с границы слова битовой карты
+    size_type offset = offsetInBlock(span.index);
+    for (size_type i = 0; i < span.count;)
+    {
+        size_type bit = (offset + i) & 63;
+        size_type wordCount = std::min<size_type>(64 - bit, span.count - i);
+        uint64_t alive = wordCount == 64 ? ~0ull : (1ull << wordCount) - 1;
+        alive &= ~(dead[(offset + i) >> 6].load(std::memory_order_acquire) >> bit);
+        while (alive != 0)
+        {
+            size_type item = i + std::countr_zero(alive);
+            alive &= alive - 1;
+            f(span.ptr[item], span.index + item);
+        }
+        i += wordCount;
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::PendingElement MassAllocator<T, BlockShift>::createPendingElement()
+{
+    PendingElement result;
+    result.ptr = createElementImpl<false>(&result.index);
+    constructElement(result.ptr);
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+template <bool Reuse>
+typename MassAllocator<T, BlockShift>::pointer MassAllocator<T, BlockShift>::createElementImpl(size_type *returningIndex, unsigned int *generation)
+{
+    //места отображения только для чтения нельзя ни выдать, ни взять из списка свободных
+    checkWritable();
+    if (Reuse && (options_ & optionRecycle) && (freeHead_.load(std::memory_order_relaxed) & freeIndexMask) != 0)
+    {
+        if (pointer reused = reuseElement(returningIndex, generation))
+            return reused;
+    }
+    //получаем новый полный индекс
+    uint64_t index = curAtomicIndex_++;
+    MASS_ALLOCATOR_STAT(countAllocations(1));
+    //старшие 32 бита - индекс блока, младшие - индекс элемента в блоке
+    unsigned int blockIndx = (unsigned int)(index >> 32);
+    unsigned int itemIndex = (unsigned int)(index & 0xffffffff);
+
+    //если индекс элемента в блоке входит в допустимые пределы, то мы быстренько возвращаем индекс и указатель выделенного элемента
+    if(itemIndex < elementsInBlock())
+    {
+        if (itemIndex == prepareThreshold_.load(std::memory_order_relaxed))
+            prepareBlock(blockIndx + 1);
+        size_type elementIndex = (size_type)blockIndx * elementsInBlock() + itemIndex;
+        if (returningIndex != nullptr)
+            *returningIndex = elementIndex;
+        if (generation != nullptr)
+            *generation = slotGeneration(elementIndex);
+        return &(blocks_[blockIndx][itemIndex]);
+    }
+
+    //блок закончился: либо выделяем новый блок сами, либо ждем другой поток
+    pointer result = nullptr;
+    claimSlow(index, 1,
+        [&](pointer ptr, size_type firstIndex, unsigned int)
+        {
+            if (returningIndex != nullptr)
+                *returningIndex = firstIndex;
+            if (generation != nullptr)
+                *generation = slotGeneration(firstIndex);
+            result = ptr;
+        });
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+std::vector<typename MassAllocator<T, BlockShift>::Span> MassAllocator<T, BlockShift>::createElements(size_type count)
+{
+    std::vector<Span> result;
+    result.reserve((size_t)(count / elementsInBlock() + 2));
+    while (count != 0)
+    {
+        unsigned int portion = (unsigned int)std::min<size_type>(count, maxClaimCount);
+        claim(portion,
+            [&](pointer ptr, size_type firstIndex, unsigned int pieceCount)
+            {
+                Span span = { ptr, firstIndex, pieceCount };
+                result.push_back(span);
+            });
+        count -= portion;
+    }
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Span MassAllocator<T, BlockShift>::createElementsInBlock(unsigned int count)
+{
+    if (count == 0 || count > elementsInBlock())
+        throw std::bad_alloc();
+    Span result = { nullptr, 0, 0 };
+    claim(count,
+        [&](pointer ptr, size_type firstIndex, unsigned int pieceCount)
+        {
+            Span span = { ptr, firstIndex, pieceCount };
+            result = span;
+        },
+        true);
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+template <typename F>
+void MassAllocator<T, BlockShift>::claim(unsigned int count, F f, bool inOneBlock)
+{
+    if constexpr (!std::is_trivially_default_constructible_v<T>)
+    {
+        //захваченные порции сразу конструируются, публикует их вызывающий после записи
+        auto construct =
+            [&]
+            (pointer ptr, size_type firstIndex, unsigned int pieceCount)
+            {
+                constructElements(ptr, pieceCount);
+                f(ptr, firstIndex, pieceCount);
+            };
+        claimImpl(count, construct, inOneBlock);
+    }
+    else
+        claimImpl(count, f, inOneBlock);
+}
+
+template <typename T, unsigned int BlockShift>
+template <typename F>
+void MassAllocator<T, BlockShift>::claimImpl(unsigned int count, F &f, bool inOneBlock)
+{
+    checkWritable();
+    uint64_t index = count <= maxFetchAddCount ? curAtomicIndex_.fetch_add(count) : claimLarge(count);
+    MASS_ALLOCATOR_STAT(countAllocations(count));
+    unsigned int blockIndx = (unsigned int)(index >> 32);
+    unsigned int itemIndex = (unsigned int)(index & 0xffffffff);
+    if ((uint64_t)itemIndex + count <= elementsInBlock())
+    {
+        prepareIfCrossed(blockIndx, itemIndex, count);
+        f(&(blocks_[blockIndx][itemIndex]), (size_type)blockIndx * elementsInBlock() + itemIndex, count);
+        return;
+    }
+    claimSlow(index, count, f, inOneBlock);
+}
+
+template <typename T, unsigned int BlockShift>
+uint64_t MassAllocator<T, BlockShift>::claimLarge(unsigned int count)
+{
+    uint64_t index = curAtomicIndex_.load();
+    for (;;)
+    {
+        //большой диапазон не добавляется к индексу, уже вышедшему за конец блока
+        if ((index & 0xffffffff) > elementsInBlock())
+        {
+            curAtomicIndex_.wait(index, std::memory_order_relaxed);
+            index = curAtomicIndex_.load();
+            continue;
+        }
+        if (curAtomicIndex_.compare_exchange_weak(index, index + count))
+            return index;
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+template <typename F>
+void MassAllocator<T, BlockShift>::claimSlow(uint64_t index, unsigned int count, F f, bool inOneBlock)
+{
+    for (;;)
+    {
+        unsigned int blockIndx = (unsigned int)(index >> 32);
+        unsigned int itemIndex = (unsigned int)(index & 0xffffffff);
+
+        //пока мы ждали, блок был выделен другим потоком, и диапазон целиком поместился в него
+        if ((uint64_t)itemIndex + count <= elementsInBlock())
+        {
+            prepareIfCrossed(blockIndx, itemIndex, count);
+            f(&(blocks_[blockIndx][itemIndex]), (size_type)blockIndx * elementsInBlock() + itemIndex, count);
+            return;
+        }
+
+        if (itemIndex <= elementsInBlock())
+        {
+            //граница блока попала в наш диапазон, именно нашему потоку нужно выделить новые блоки
+            unsigned int head = elementsInBlock() - itemIndex;
+            if (inOneBlock && head != 0)
+            {
+                //остаток блока пропускаем, весь диапазон берем в начале следующего блока
+                abandon(&(blocks_[blockIndx][itemIndex]), (size_type)blockIndx * elementsInBlock() + itemIndex, head);
+                head = 0;
+            }
+            uint64_t rest = count - head;
+            unsigned int newBlocks = (unsigned int)((rest + elementsInBlock() - 1) / elementsInBlock());
+            unsigned int lastFill = (unsigned int)(rest - (uint64_t)(newBlocks - 1) * elementsInBlock());
+            for (unsigned int i = 1; i <= newBlocks; ++i)
+                acquireBlock(blockIndx + i);
+
+            //устанавливаем счетчик за последним захваченным элементом и будим ожидающие потоки
+            unsigned int lastBlock = blockIndx + newBlocks;
+            setIndex(lastBlock, lastFill);
+            curAtomicIndex_.notify_all();
+            prepareIfCrossed(lastBlock, 0, lastFill);
+
+            if (head != 0)
+                f(&(blocks_[blockIndx][itemIndex]), (size_type)blockIndx * elementsInBlock() + itemIndex, head);
+            for (unsigned int i = 1; i <= newBlocks; ++i)
+            {
+                unsigned int b = blockIndx + i;
+                f(blocks_[b], (size_type)b * elementsInBlock(), b == lastBlock ? lastFill : elementsInBlock());
+            }
+            return;
+        }
+
+        //ждем, пока другой поток производит выделение нового блока
+        MASS_ALLOCATOR_STAT(auto waitStart = std::chrono::steady_clock::now());
+        do
+        {
+            // блок еще не выделен, засыпаем до изменения сквозного индекса
+            curAtomicIndex_.wait(index, std::memory_order_relaxed);
+            index = curAtomicIndex_.load(std::memory_order_relaxed);
+            MASS_ALLOCATOR_STAT(counters_.waitIterations.fetch_add(1, std::memory_order_relaxed));
+        } while ((index & 0xffffffff) > elementsInBlock());
+        MASS_ALLOCATOR_STAT(counters_.waitNs.fetch_add(elapsedNs(waitStart), std::memory_order_relaxed));
+
+        //блок был выделен, резервируем диапазон
+        index = count <= maxFetchAddCount ? curAtomicIndex_.fetch_add(count) : claimLarge(count);
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+T* MassAllocator<T, BlockShift>::allocateBlock(unsigned int blockIndx)
+{
+    auto bufferSize = blockBytes();
+#ifdef __linux__
+    if (fileFd_ >= 0)
+        return mapFileBlock(blockIndx);
+    if (options_ & optionMmap)
+    {
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        if (options_ & optionPopulate)
+            flags |= MAP_POPULATE;
+        if (options_ & optionHugePages)
+        {
+            //большая страница возможна только для выровненного на ее размер участка,
+            //поэтому отображаем с запасом и обрезаем края
+            const size_t hugePageSize = 2 * 1024 * 1024;
+            size_t mappedSize = bufferSize + hugePageSize;
+            char *mapped = (char*)mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, flags & ~MAP_POPULATE, -1, 0);
+            if (mapped == MAP_FAILED)
+                throw std::bad_alloc();
+            char *aligned = (char*)(((uintptr_t)mapped + hugePageSize - 1) & ~(uintptr_t)(hugePageSize - 1));
+            size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+            size_t usedSize = (bufferSize + pageSize - 1) & ~(pageSize - 1);
+            if (aligned != mapped)
+                munmap(mapped, aligned - mapped);
+            if (mapped + mappedSize != aligned + usedSize)
+                munmap(aligned + usedSize, mapped + mappedSize - (aligned + usedSize));
+            madvise(aligned, usedSize, MADV_HUGEPAGE);
+            if (options_ & optionPopulate)
+                prefaultPages(aligned, usedSize);
+            return (T*)aligned;
+        }
+        void *mapped = mmap(nullptr, bufferSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (mapped == MAP_FAILED)
+            throw std::bad_alloc();
+        return (T*)mapped;
+    }
+#else
+    (void)blockIndx;
+#endif
+    T* buffer = (T*)malloc(bufferSize);
+    if (buffer == nullptr)
+        throw std::bad_alloc();
+    memset((void*)buffer, 0, bufferSize);
+    return buffer;
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::freeBlock(T *block)
+{
+#ifdef __linux__
+    if (fileFd_ >= 0)
+    {
+        munmap(block, fileBlockStride());
+        return;
+    }
+    if (options_ & optionMmap)
+    {
+        munmap(block, blockBytes());
+        return;
+    }
+#endif
+    free(block);
+}
+
+template <typename T, unsigned int BlockShift>
+uint64_t MassAllocator<T, BlockShift>::typeFingerprint()
+{
+    //FNV-1a по имени типа, затем размер и выравнивание
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *name = typeid(T).name(); *name != 0; ++name)
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ull;
+    hash = (hash ^ sizeof(T)) * 1099511628211ull;
+    hash = (hash ^ alignof(T)) * 1099511628211ull;
+    return hash;
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::closeFile()
+{
+#ifdef __linux__
+    if (fileFd_ >= 0)
+        ::close(fileFd_);
+#endif
+    fileFd_ = -1;
+    fileReadOnly_ = false;
+    fileSize_ = 0;
+}
+
+#ifdef __linux__
+template <typename T, unsigned int BlockShift>
+T* MassAllocator<T, BlockShift>::mapFileBlock(unsigned int blockIndx)
+{
+    if (fileReadOnly_)
+        throw std::system_error(std::make_error_code(std::errc::read_only_file_system), "MassAllocator: new block in a read-only file");
+    size_t stride = fileBlockStride();
+    size_t offset = fileHeaderSize() + (size_t)blockIndx * stride;
+    {
+        //блоки могут отображаться несколькими потоками, файл только растет
+        std::lock_guard<std::mutex> lock(fileMutex_);
+        if (fileSize_ < offset + stride)
+        {
+            if (ftruncate(fileFd_, (off_t)(offset + stride)) != 0)
+                throw std::system_error(errno, std::generic_category(), "MassAllocator: ftruncate");
+            fileSize_ = offset + stride;
+        }
+    }
+    int flags = MAP_SHARED;
+    if (options_ & optionPopulate)
+        flags |= MAP_POPULATE;
+    void *mapped = mmap(nullptr, stride, PROT_READ | PROT_WRITE, flags, fileFd_, (off_t)offset);
+    if (mapped == MAP_FAILED)
+        throw std::system_error(errno, std::generic_category(), "MassAllocator: mmap");
+    return (T*)mapped;
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::writeFileHeader(uint64_t count)
+{
+    MassAllocatorFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "MASSALC1", sizeof(header.magic));
+    header.version = 1;
+    header.blockSize = elementsInBlock();
+    header.elementSize = sizeof(T);
+    header.headerSize = (uint32_t)fileHeaderSize();
+    header.blockStride = fileBlockStride();
+    header.count = count;
+    header.typeFingerprint = typeFingerprint();
+    if (pwrite(fileFd_, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+        throw std::system_error(errno, std::generic_category(), "MassAllocator: write header");
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::truncateFile(size_t blocksCount)
+{
+    std::lock_guard<std::mutex> lock(fileMutex_);
+    size_t fileSize = fileHeaderSize() + blocksCount * fileBlockStride();
+    if (fileSize < fileSize_)
+    {
+        if (ftruncate(fileFd_, (off_t)fileSize) != 0)
+            throw std::system_error(errno, std::generic_category(), "MassAllocator: ftruncate");
+        fileSize_ = fileSize;
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::createFile(const std::string &path)
+{
+    static_assert(std::is_trivially_copyable_v<T>, "file-backed storage requires a trivially copyable T");
+    clear();
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "MassAllocator: create " + path);
+    fileFd_ = fd;
+    try
+    {
+        writeFileHeader(0);
+        if (ftruncate(fileFd_, (off_t)fileHeaderSize()) != 0)
+            throw std::system_error(errno, std::generic_category(), "MassAllocator: ftruncate");
+        fileSize_ = fileHeaderSize();
+    }
+    catch (...)
+    {
+        closeFile();
+        throw;
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::open(const std::string &path, FileMode mode)
+{
+    static_assert(std::is_trivially_copyable_v<T>, "file-backed storage requires a trivially copyable T");
+    clear();
+    bool readOnly = mode == fileReadOnly;
+    int fd = ::open(path.c_str(), (readOnly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "MassAllocator: open " + path);
+
+    MassAllocatorFileHeader header;
+    struct stat fileStat;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fstat(fd, &fileStat) != 0)
+    {
+        int error = errno != 0 ? errno : EIO;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "MassAllocator: read header of " + path);
+    }
+    size_t stride = fileBlockStride();
+    uint64_t blocksCount = (header.count + elementsInBlock() - 1) / elementsInBlock();
+    if (memcmp(header.magic, "MASSALC1", sizeof(header.magic)) != 0 || header.version != 1
+        || header.blockSize != elementsInBlock() || header.elementSize != sizeof(T)
+        || header.typeFingerprint != typeFingerprint() || header.headerSize != fileHeaderSize()
+        || header.blockStride != stride || blocksCount > MassBlockDirectory<T>::capacity()
+        || fileHeaderSize() + blocksCount * stride > (uint64_t)fileStat.st_size)
+    {
+        ::close(fd);
+        throw std::system_error(std::make_error_code(std::errc::invalid_argument), "MassAllocator: incompatible file " + path);
+    }
+
+    //все блоки одним отображением, отдельные блоки потом освобождаются munmap своего участка
+    char *base = nullptr;
+    if (blocksCount != 0)
+    {
+        void *mapped = mmap(nullptr, blocksCount * stride, readOnly ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)fileHeaderSize());
+        if (mapped == MAP_FAILED)
+        {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "MassAllocator: mmap " + path);
+        }
+        base = (char*)mapped;
+    }
+    fileFd_ = fd;
+    fileReadOnly_ = readOnly;
+    fileSize_ = (size_t)fileStat.st_size;
+    for (unsigned int i = 0; i < blocksCount; ++i)
+    {
+        blocks_.set(i, (T*)(base + i * stride));
+        ensureBlockState(i);
+    }
+    blocksCount_.store((unsigned int)blocksCount);
+    if (blocksCount == 0)
+        return;
+
+    unsigned int lastBlock = (unsigned int)blocksCount - 1;
+    unsigned int lastFill = (unsigned int)(header.count - (uint64_t)lastBlock * elementsInBlock());
+    if (!readOnly)
+    {
+        //после save() могли создаваться элементы, которые не попали в заголовок: новые элементы должны быть нулевыми
+        truncateFile(blocksCount);
+        memset((void*)(blocks_[lastBlock] + lastFill), 0, (size_t)(elementsInBlock() - lastFill) * sizeof(T));
+    }
+    if (options_ & optionTrackCommits)
+        commitRange(0, header.count);
+    setIndex(lastBlock, lastFill);
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::save()
+{
+    if (fileFd_ < 0)
+        throw std::system_error(std::make_error_code(std::errc::bad_file_descriptor), "MassAllocator: save without a file");
+    if (fileReadOnly_)
+        throw std::system_error(std::make_error_code(std::errc::read_only_file_system), "MassAllocator: save of a read-only file");
+    //сначала данные, затем заголовок с количеством элементов
+    for (unsigned int i = 0, n = blocksCount_.load(); i < n; ++i)
+    {
+        if (msync(blocks_[i], fileBlockStride(), MS_SYNC) != 0)
+            throw std::system_error(errno, std::generic_category(), "MassAllocator: msync");
+    }
+    writeFileHeader(size());
+    if (fdatasync(fileFd_) != 0)
+        throw std::system_error(errno, std::generic_category(), "MassAllocator: fdatasync");
+}
+#endif
+
+template <typename T, unsigned int BlockShift>
+T* MassAllocator<T, BlockShift>::ensureBlock(unsigned int blockIndx, bool prefault)
+{
+    T *block = blocks_.find(blockIndx);
+    if (block == nullptr)
+    {
+        MASS_ALLOCATOR_STAT(auto allocationStart = std::chrono::steady_clock::now());
+        block = allocateBlock(blockIndx);
+#ifdef __linux__
+        //запись в страницы допустима только пока блок не опубликован: после install() в него уже пишут элементы
+        if (prefault && (options_ & optionMmap) && !(options_ & optionPopulate))
+            prefaultPages(block, blockBytes());
+#else
+        (void)prefault;
+#endif
+        MASS_ALLOCATOR_STAT(counters_.blockAllocationNs.fetch_add(elapsedNs(allocationStart), std::memory_order_relaxed));
+        if (blocks_.install(blockIndx, block))
+        {
+            blocksCount_.fetch_add(1);
+            MASS_ALLOCATOR_STAT(counters_.blocksAllocated.fetch_add(1, std::memory_order_relaxed));
+        }
+        else
+        {
+            //блок успел создать другой поток
+            freeBlock(block);
+            block = blocks_[blockIndx];
+            MASS_ALLOCATOR_STAT(counters_.blocksDiscarded.fetch_add(1, std::memory_order_relaxed));
+        }
+    }
+    //служебные данные должны появиться раньше, чем элементы блока будут выданы
+    ensureBlockState(blockIndx);
+    return block;
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::ensureBlockState(unsigned int blockIndx)
+{
+    if (options_ & optionTrackCommits)
+        ensureBlockData(commitBits_, blockIndx, bitWords());
+    if (options_ & optionRecycle)
+    {
+        ensureBlockData(slotStates_, blockIndx, elementsInBlock());
+        ensureBlockData(deadBits_, blockIndx, bitWords());
+    }
+}
 
-    ///Итератор для хранилища.
-    class Iterator
+template <typename T, unsigned int BlockShift>
+T* MassAllocator<T, BlockShift>::acquireBlock(unsigned int blockIndx)
+{
+    T *block = ensureBlock(blockIndx);
+    //блоки заполняются по порядку, поэтому достаточно помнить границу уже обнуленных
+    if (blockIndx < dirtyBlocks_.load(std::memory_order_relaxed) && blockIndx >= zeroedBlocks_.load(std::memory_order_acquire))
     {
-    public:
-        typedef typename std::random_access_iterator_tag iterator_category;
-        typedef T value_type;
-        typedef size_t difference_type;
-        typedef T* pointer;
-        typedef T& reference;
+        //блок может одновременно готовить поток, пересекший порог подготовки
+        std::lock_guard<std::mutex> lock(zeroMutex_);
+        if (blockIndx >= zeroedBlocks_.load(std::memory_order_relaxed))
+        {
+            MASS_ALLOCATOR_STAT(auto zeroStart = std::chrono::steady_clock::now());
+            memset((void*)block, 0, blockBytes());
+            zeroedBlocks_.store(blockIndx + 1, std::memory_order_release);
+            MASS_ALLOCATOR_STAT(counters_.blocksZeroed.fetch_add(1, std::memory_order_relaxed));
+            MASS_ALLOCATOR_STAT(counters_.blockAllocationNs.fetch_add(elapsedNs(zeroStart), std::memory_order_relaxed));
+        }
+    }
+    return block;
+}
 
-        ///Перемещает итератор на следующий элемент хранилища
-        Iterator& operator++();
-        Iterator operator++(int);
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::prepareBlock(unsigned int blockIndx)
+{
+    if (options_ & optionBackgroundRefill)
+    {
+        refillRequest_.store(blockIndx);
+        refillRequest_.notify_one();
+        return;
+    }
+    try
+    {
+        acquireBlock(blockIndx);
+    }
+    catch (const std::bad_alloc &)
+    {
+        //не смогли подготовить заранее, блок будет выделен при переходе на него
+    }
+}
 
-        ///Перемещает итератор на предыдущий элемент хранилища
-        Iterator& operator--();
-        Iterator operator--(int);
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::refillLoop()
+{
+    for (;;)
+    {
+        refillRequest_.wait(noBlock);
+        if (refillStop_.load())
+            return;
+        //запрос забирается под блокировкой: clear() и reset() сбрасывают его под ней же,
+        //поэтому запрос предыдущего заполнения не может выполниться после очистки
+        std::lock_guard<std::mutex> lock(refillMutex_);
+        unsigned int blockIndx = refillRequest_.exchange(noBlock);
+        if (blockIndx == noBlock)
+            continue;
+        try
+        {
+            acquireBlock(blockIndx);
+        }
+        catch (const std::bad_alloc &)
+        {
+            //блок будет выделен при переходе на него
+        }
+    }
+}
 
-        difference_type operator-(const Iterator &rh) const;
-        Iterator operator-(difference_type offset) const;
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::stopRefill()
+{
+    if (!refillThread_.joinable())
+        return;
+    refillStop_.store(true);
+    //любое значение, отличное от noBlock, будит поток
+    refillRequest_.store(0);
+    refillRequest_.notify_one();
+    refillThread_.join();
+}
 
-        Iterator operator+(difference_type offset) const;
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::reserve(size_type count, bool prefault)
+{
+    size_type blocksNeeded = blockOf(count + elementsInBlock() - 1);
+    for (size_type blockIndx = 0; blockIndx < blocksNeeded; ++blockIndx)
+    {
+        //страницы уже существующего блока могут содержать элементы, поэтому отображаются только новые блоки
+        ensureBlock((unsigned int)blockIndx, prefault);
+    }
+}
 
-        ///Возвращает указатель на элемент, на котором находится итератор
-        pointer operator->();
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::reference MassAllocator<T, BlockShift>::operator[](size_type index)
+{
+    size_t indexOfBlock = blockOf(index);
+    size_t indexInBlock = offsetInBlock(index);
+    return blocks_[indexOfBlock][indexInBlock];
+}
 
-        ///Возвращает ссылку на элемент, на котором находится итератор
-        reference operator*();
+template <typename T, unsigned int BlockShift>
+template <typename Indices, typename F>
+void MassAllocator<T, BlockShift>::forEachIndex(const Indices &indices, F f, unsigned int prefetchDistance)
+{
+    forEachIndexImpl(*this, indices, f, prefetchDistance);
+}
 
-        ///Равенство итераторов
-        bool operator==(const Iterator &rh) const;
+template <typename T, unsigned int BlockShift>
+template <typename Indices, typename F>
+void MassAllocator<T, BlockShift>::forEachIndex(const Indices &indices, F f, unsigned int prefetchDistance) const
+{
+    forEachIndexImpl(*this, indices, f, prefetchDistance);
+}
 
-        ///Сравнение итераторов на меньше
-        bool operator<(const Iterator &rh) const;
+template <typename T, unsigned int BlockShift>
+template <typename Self, typename Indices, typename F>
+void MassAllocator<T, BlockShift>::forEachIndexImpl(Self &self, const Indices &indices, F &f, unsigned int prefetchDistance)
+{
+    prefetchDistance = std::clamp(prefetchDistance, 1u, maxPrefetchDistance);
+    //кольцо адресов элементов, уже запрошенных у памяти, и их индексов;
+    //для константного хранилища operator[] дает const_reference
+    using ElementPtr = decltype(&self[size_type()]);
+    ElementPtr pending[maxPrefetchDistance];
+    size_type pendingIndex[maxPrefetchDistance];
+    auto ahead = std::begin(indices);
+    auto end = std::end(indices);
+    unsigned int queued = 0;
+    for (; queued < prefetchDistance && ahead != end; ++ahead, ++queued)
+    {
+        pendingIndex[queued] = (size_type)*ahead;
+        pending[queued] = &self[pendingIndex[queued]];
+        prefetchElement(pending[queued]);
+    }
+    for (unsigned int slot = 0; queued != 0; slot = slot + 1 == prefetchDistance ? 0 : slot + 1)
+    {
+        ElementPtr ptr = pending[slot];
+        size_type index = pendingIndex[slot];
+        //место в кольце сразу занимает элемент, отстоящий на prefetchDistance вперед
+        if (ahead != end)
+        {
+            pendingIndex[slot] = (size_type)*ahead;
+            pending[slot] = &self[pendingIndex[slot]];
+            prefetchElement(pending[slot]);
+            ++ahead;
+        }
+        else
+            --queued;
+        f(*ptr, index);
+    }
+}
 
-        ///Неравенство итераторов
-        bool operator!=(const Iterator &rh) const;
+template <typename T, unsigned int BlockShift>
+template <typename Indices, typename OutputIt>
+OutputIt MassAllocator<T, BlockShift>::gather(const Indices &indices, OutputIt out, unsigned int prefetchDistance) const
+{
+    forEachIndex(indices,
+        [&](const_reference element, size_type)
+        {
+            *out = element;
+            ++out;
+        },
+        prefetchDistance);
+    return out;
+}
 
-        ///Возвращает индекс элемента, на котором находится итератор
-        size_type getIndex() const;
-    private:
-        friend class MassAllocator;
-        MassAllocator *MassAllocator_;
-        size_type index_;
-    };
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::const_reference MassAllocator<T, BlockShift>::operator[](size_type index) const
+{
+    size_t indexOfBlock = blockOf(index);
+    size_t indexInBlock = offsetInBlock(index);
+    return blocks_[indexOfBlock][indexInBlock];
+}
 
-    ///Возвращает итератор на начало хранилища
-    Iterator begin();
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator MassAllocator<T, BlockShift>::begin()
+{
+    Iterator result;
+    result.MassAllocator_ = this;
+    result.index_ = 0;
+    return result;
+}
 
-    ///Возвращает итератор на конец хранилища
-    Iterator end();
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator MassAllocator<T, BlockShift>::end()
+{
+    Iterator result;
+    result.MassAllocator_ = this;
+    result.index_ = size();
+    return result;
+}
 
-    ///Kоличество элементов
-    size_t size() const;
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::SegmentedIterator MassAllocator<T, BlockShift>::segmentedBegin()
+{
+    SegmentedIterator result;
+    result.MassAllocator_ = this;
+    result.size_ = size();
+    result.blocksCount_ = blockOf(result.size_ + elementsInBlock() - 1);
+    result.ptr_ = result.blockEnd_ = nullptr;
+    result.blockIndx_ = 0;
+    if (result.size_ != 0)
+        result.setBlock(0);
+    return result;
+}
 
-    ///Очищает хранилище, сбрасывает индекс.
-    void clear();
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::SegmentedIterator MassAllocator<T, BlockShift>::segmentedEnd()
+{
+    SegmentedIterator result;
+    result.MassAllocator_ = this;
+    result.size_ = size();
+    result.blocksCount_ = blockOf(result.size_ + elementsInBlock() - 1);
+    result.ptr_ = result.blockEnd_ = nullptr;
+    result.blockIndx_ = 0;
+    if (result.size_ != 0)
+    {
+        result.setBlock(result.blocksCount_ - 1);
+        result.ptr_ = result.blockEnd_;
+    }
+    return result;
+}
 
-    ///Возвращает потребление памяти
-    size_t memUse() const;
-private:
-    //Запрет копирования
-    MassAllocator(const MassAllocator &);
-    MassAllocator& operator=(const MassAllocator &);
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator MassAllocator<T, BlockShift>::committedEnd()
+{
+    Iterator result;
+    result.MassAllocator_ = this;
+    result.index_ = committedSize();
+    return result;
+}
 
-    ///Количество элементов в блоке.
-    unsigned int elementsInBlockCount_;
-    ///Блоки с элементами.
-    std::vector<T*> blocks_; // вектор массивов 
+template <typename T, unsigned int BlockShift>
+template <typename F>
+void MassAllocator<T, BlockShift>::forEachBlockUpTo(size_type n, F f)
+{
+    for (size_t blockIndx = 0, first = 0; first < n; ++blockIndx, first += elementsInBlock())
+        f(blocks_[(unsigned int)blockIndx], (size_type)std::min<size_t>(elementsInBlock(), n - first));
+}
 
-    ///Сквозной индекс для захвата следующего свободного элемента.
-    ///Cтаршие 32 бита это индекс блока, а нижние 32 бита - индекс элемента в блоке.
-    std::atomic<uint64_t> curAtomicIndex_;
+template <typename T, unsigned int BlockShift>
+std::vector<typename MassAllocator<T, BlockShift>::Span> MassAllocator<T, BlockShift>::segments()
+{
+    std::vector<Span> result;
+    size_type first = 0;
+    forEachBlock(
+        [&](pointer ptr, size_type count)
+        {
+            Span span = { ptr, first, count };
+            result.push_back(span);
+            first += count;
+        });
+    return result;
+}
 
-    ///Задает значение сквозного индекс по номеру блока и индексу в блоке.
-    void setIndex(unsigned int blockIndx, unsigned int itemIndex);
-};
+template <typename T, unsigned int BlockShift>
+size_t MassAllocator<T, BlockShift>::size() const
+{
+    auto index = curAtomicIndex_.load();
+    size_t blockIndx = index >> 32;
+    if (blockIndx == noBlock)
+        return 0;
+    //пока выделяется новый блок, индекс элемента выходит за пределы блока
+    size_t lastIndexInBlock = std::min<size_t>(index & 0xffffffff, elementsInBlock());
+    return blockIndx * elementsInBlock() + lastIndexInBlock;
+}
 
-template <typename T>
-MassAllocator<T>::MassAllocator(unsigned int blockSize)
-    : elementsInBlockCount_(blockSize)
+template <typename T, unsigned int BlockShift>
+size_t MassAllocator<T, BlockShift>::memUse() const
 {
-    //задаем значение сквозного индекса таким, чтобы первое выделение элемента привело к распределению нового блока
-    setIndex(0, elementsInBlockCount_);
+    return (size_t)blocksCount_.load() * elementsInBlock() * sizeof(T);
 }
 
-template <typename T>
-MassAllocator<T>::~MassAllocator()
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::releaseBlock(unsigned int blockIndx)
 {
-    clear();
+    freeBlock(blocks_[blockIndx]);
+    blocks_.set(blockIndx, nullptr);
+    releaseBlockData(commitBits_, blockIndx);
+    releaseBlockData(slotStates_, blockIndx);
+    releaseBlockData(deadBits_, blockIndx);
 }
 
-template <typename T>
-void MassAllocator<T>::setIndex(unsigned int blockIndx, unsigned int itemIndex)
+template <typename T, unsigned int BlockShift>
+template <typename U>
+void MassAllocator<T, BlockShift>::ensureBlockData(MassBlockDirectory<U> &directory, unsigned int blockIndx, unsigned int count)
 {
-    auto a = (((uint64_t)blockIndx) << 32) + itemIndex;
-    curAtomicIndex_.store(a);
+    if (directory.find(blockIndx) != nullptr)
+        return;
+    //атомарные значения инициализируются нулями
+    U *data = new U[count]();
+    if (!directory.install(blockIndx, data))
+        delete[] data;
 }
 
-template <typename T>
-typename MassAllocator<T>::pointer MassAllocator<T>::createElement(size_type *returningIndex)
-{
-    //Делаем union для доступа к старшим и младшим 32 битам 64 битного целого
-    union {
-        uint64_t index;
-        struct HiLoParts {
-            uint32_t itemIndex;
-            uint32_t blockIndx;
-        } parts;
-    };
-    //получаем новый полный индекс
-    index = curAtomicIndex_++;
+template <typename T, unsigned int BlockShift>
+template <typename U>
+void MassAllocator<T, BlockShift>::releaseBlockData(MassBlockDirectory<U> &directory, unsigned int blockIndx)
+{
+    if (U *data = directory.find(blockIndx))
+    {
+        directory.set(blockIndx, nullptr);
+        delete[] data;
+    }
+}
 
-    //если индекс элемента в блоке входит в допустимые пределы, то мы быстренько возвращаем индекс и указатель выделенного элемента
-    if(parts.itemIndex < elementsInBlockCount_)
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::commitRange(size_type first, size_type count)
+{
+    //отмечаем элементы в битовых картах блоков
+    for (size_type last = first + count; first < last;)
     {
-        if (returningIndex != nullptr)
-            *returningIndex = parts.blockIndx * elementsInBlockCount_ + parts.itemIndex;
-        return &(blocks_[parts.blockIndx][parts.itemIndex]);
+        unsigned int item = (unsigned int)offsetInBlock(first);
+        unsigned int n = (unsigned int)std::min<size_type>(last - first, elementsInBlock() - item);
+        std::atomic<uint64_t> *bits = commitBits_[(unsigned int)blockOf(first)];
+        for (unsigned int i = item, end = item + n; i < end;)
+        {
+            unsigned int shift = i & 63;
+            unsigned int k = std::min(64 - shift, end - i);
+            uint64_t mask = (k == 64 ? ~0ull : (1ull << k) - 1) << shift;
+            bits[i >> 6].fetch_or(mask);
+            i += k;
+        }
+        first += n;
     }
-    commitBlock:
-    if (parts.itemIndex == elementsInBlockCount_)
+
+    //продвигаем границу, пока за ней есть опубликованные элементы.
+    //Биты выставлены до чтения границы, поэтому последний опубликовавший поток увидит все элементы перед своими
+    //и не остановится, пока граница их не пройдет.
+    for (;;)
     {
-        //на нас закончился блок и именно нашему потоку нужно выделить еще один блок памяти
-        auto bufferSize = elementsInBlockCount_ * sizeof(T);
-        T* buffer = (T*)malloc(bufferSize);
-        if (buffer == nullptr)
-            throw std::bad_alloc();
-        memset(buffer, 0, bufferSize);
-        blocks_.push_back(buffer);
-        
-        //мы забираем себе нулевой элемент в блоке
-        parts.blockIndx = (unsigned int)(blocks_.size() - 1);
-        parts.itemIndex = 0;
-        if (returningIndex != nullptr)
-            *returningIndex = parts.blockIndx * elementsInBlockCount_ + parts.itemIndex;
-        //устанавливаем счетчик на первый элемент в блоке
-        setIndex(parts.blockIndx, 1);
-        return &(blocks_[parts.blockIndx][parts.itemIndex]);
+        size_type watermark = committed_.load();
+        size_type run = committedRun(watermark);
+        if (run == 0)
+            break;
+        committed_.compare_exchange_weak(watermark, watermark + run);
     }
+}
 
-    //ждем, пока другой поток производит выделение нового блока
-    do
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::size_type MassAllocator<T, BlockShift>::committedRun(size_type first) const
+{
+    size_type run = 0;
+    for (;;)
     {
-        do
-        {
-            // блок еще не выделен, продолжаем ожидание relaxed-чтением
-            std::this_thread::yield();
-            index = curAtomicIndex_.load(std::memory_order_relaxed);
-        } while (parts.itemIndex > elementsInBlockCount_);
-        
-        //блок был выделен, резервируем элемент
-        index = curAtomicIndex_++;
-    } while (parts.itemIndex > elementsInBlockCount_);
-     
-    if (parts.itemIndex == elementsInBlockCount_)
-        //нам не повезло, к моменту пока мы очнулись именно на нас закончился блок
-        goto commitBlock;
-
-    //блок был выделен другим потоком, мы захватили валидный индекс элемента из нового блока
-    if (returningIndex != nullptr)
-        *returningIndex = parts.blockIndx * elementsInBlockCount_ + parts.itemIndex;
-    return &(blocks_[parts.blockIndx][parts.itemIndex]);
+        size_type index = first + run;
+        std::atomic<uint64_t> *bits = commitBits_.find((unsigned int)blockOf(index));
+        if (bits == nullptr)
+            return run;
+        unsigned int item = (unsigned int)offsetInBlock(index);
+        unsigned int shift = item & 63;
+        unsigned int ones = (unsigned int)std::countr_one(bits[item >> 6].load() >> shift);
+        run += ones;
+        //продолжаем, только если слово опубликовано до конца или закончился блок
+        if (item + ones != elementsInBlock() && ones != 64 - shift)
+            return run;
+    }
+}
 
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::clear()
+{
+    clearImpl(1);
 }
 
-template <typename T>
-typename MassAllocator<T>::reference MassAllocator<T>::operator[](size_type index)
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::clearImpl(unsigned int threadsCount)
 {
-    size_t indexOfBlock = index / elementsInBlockCount_;
-    size_t indexInBlock = index % elementsInBlockCount_;
-    return blocks_[indexOfBlock][indexInBlock];
+    //дожидаемся, пока фоновый поток закончит подготовку блока
+    std::lock_guard<std::mutex> lock(refillMutex_);
+    refillRequest_.store(noBlock);
+    destroyElements();
+    //почистить все блоки данных, каждый блок освобождается независимо от остальных
+    massParallelFor(blocksCount_.load(),
+        [&](size_t blockIndx)
+        {
+            releaseBlock((unsigned int)blockIndx);
+        },
+        threadsCount);
+    closeFile();
+    blocksCount_.store(0);
+    dirtyBlocks_.store(0);
+    zeroedBlocks_.store(0);
+    committed_.store(0);
+    freeHead_.store(0);
+    deadCount_.store(0);
+    //задаем значение сквозного индекса таким, чтобы первое выделение элемента привело к распределению нового блока
+    setIndex(noBlock, elementsInBlock());
 }
 
-template <typename T>
-typename MassAllocator<T>::const_reference MassAllocator<T>::operator[](size_type index) const
+template <typename T, unsigned int BlockShift>
+std::unique_ptr<MassAllocator<T, BlockShift>> MassAllocator<T, BlockShift>::detach()
 {
-    size_t indexOfBlock = index / elementsInBlockCount_;
-    size_t indexInBlock = index % elementsInBlockCount_;
-    return blocks_[indexOfBlock][indexInBlock];
+    std::unique_ptr<MassAllocator> detached(new MassAllocator(elementsInBlock(), options_ & ~optionBackgroundRefill));
+    //дожидаемся, пока фоновый поток закончит подготовку блока
+    std::lock_guard<std::mutex> lock(refillMutex_);
+    refillRequest_.store(noBlock);
+    detached->prepareThreshold_.store(prepareThreshold_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    detached->blocks_.swap(blocks_);
+    detached->commitBits_.swap(commitBits_);
+    detached->slotStates_.swap(slotStates_);
+    detached->deadBits_.swap(deadBits_);
+    detached->blocksCount_.store(blocksCount_.exchange(0));
+    detached->dirtyBlocks_.store(dirtyBlocks_.exchange(0));
+    detached->zeroedBlocks_.store(zeroedBlocks_.exchange(0));
+    detached->committed_.store(committed_.exchange(0));
+    detached->freeHead_.store(freeHead_.exchange(0));
+    detached->deadCount_.store(deadCount_.exchange(0));
+    detached->curAtomicIndex_.store(curAtomicIndex_.load());
+    //файл переходит вместе с отображенными из него блоками
+    detached->fileFd_ = fileFd_;
+    detached->fileReadOnly_ = fileReadOnly_;
+    detached->fileSize_ = fileSize_;
+    fileFd_ = -1;
+    fileReadOnly_ = false;
+    fileSize_ = 0;
+    setIndex(noBlock, elementsInBlock());
+    return detached;
 }
 
-template <typename T>
-typename MassAllocator<T>::Iterator MassAllocator<T>::begin()
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::clearAsync(unsigned int threadsCount)
 {
-    Iterator result;
-    result.MassAllocator_ = this;
-    result.index_ = 0;
-    return result;
+    std::unique_ptr<MassAllocator> detached = detach();
+    //новый поток сначала освобождает свои блоки, затем дожидается предыдущего, поэтому вызов не блокируется
+    releaseThread_ = std::thread(
+        [detached = std::move(detached), previous = std::move(releaseThread_), threadsCount]
+        () mutable
+        {
+            detached->clearImpl(threadsCount);
+            if (previous.joinable())
+                previous.join();
+        });
 }
 
-template <typename T>
-typename MassAllocator<T>::Iterator MassAllocator<T>::end()
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::waitClearAsync()
 {
-    Iterator result;
-    result.MassAllocator_ = this;
-    result.index_ = size();
-    return result;
+    if (releaseThread_.joinable())
+        releaseThread_.join();
 }
 
-template <typename T>
-size_t MassAllocator<T>::size() const
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::reset(ZeroPolicy zeroPolicy, size_type keepElements)
 {
-    if (blocks_.empty())
-        return 0;
+    //дожидаемся, пока фоновый поток закончит подготовку блока
+    std::lock_guard<std::mutex> lock(refillMutex_);
+    refillRequest_.store(noBlock);
+    if (fileReadOnly_)
+        throw std::system_error(std::make_error_code(std::errc::read_only_file_system), "MassAllocator: reset of a read-only file");
+    destroyElements();
     auto index = curAtomicIndex_.load();
-    size_t blocksCount = index >> 32;
-    size_t lastIndexInBlock = index & 0xffffffff;
-    return blocksCount * elementsInBlockCount_ + lastIndexInBlock;
-}
+    unsigned int usedBlocks = (index >> 32) == noBlock ? 0 : (unsigned int)(index >> 32) + 1;
+    unsigned int dirtyBlocks = std::max(dirtyBlocks_.load(), usedBlocks);
+    unsigned int blocksCount = blocksCount_.load();
+    unsigned int keepBlocks = (unsigned int)std::min<size_type>(blocksCount, blockOf(std::min<size_type>(keepElements, (size_type)-1 - elementsInBlock()) + elementsInBlock() - 1));
 
-template <typename T>
-size_t MassAllocator<T>::memUse() const
+    //возвращаем системе блоки сверх необходимых
+    if (keepBlocks < blocksCount)
+    {
+#ifdef __linux__
+        if ((options_ & optionMmap) && fileFd_ < 0)
+        {
+            //отображение остается, страницы при следующем обращении будут нулевыми
+            for (unsigned int i = keepBlocks; i < dirtyBlocks; ++i)
+                madvise(blocks_[i], blockBytes(), MADV_DONTNEED);
+        }
+        else
+#endif
+        {
+            for (unsigned int i = keepBlocks; i < blocksCount; ++i)
+                releaseBlock(i);
+            blocksCount_.store(keepBlocks);
+#ifdef __linux__
+            //при повторном увеличении файл дополняется нулями
+            if (fileFd_ >= 0)
+                truncateFile(keepBlocks);
+#endif
+        }
+        dirtyBlocks = std::min(dirtyBlocks, keepBlocks);
+    }
+
+    switch (zeroPolicy)
+    {
+    case zeroEager:
+        massParallelFor(dirtyBlocks,
+            [&](size_t blockIndx)
+            {
+                memset((void*)blocks_[(unsigned int)blockIndx], 0, blockBytes());
+            });
+        dirtyBlocks_.store(0);
+        break;
+    case zeroLazy:
+        dirtyBlocks_.store(dirtyBlocks);
+        break;
+    case zeroNone:
+        dirtyBlocks_.store(0);
+        break;
+    }
+    zeroedBlocks_.store(0);
+    //оставшиеся блоки снова не опубликованы и не содержат освобожденных элементов
+    for (unsigned int i = 0; i < usedBlocks; ++i)
+    {
+        for (auto bits : { commitBits_.find(i), deadBits_.find(i) })
+        {
+            if (bits == nullptr)
+                continue;
+            for (unsigned int w = 0, n = bitWords(); w < n; ++w)
+                bits[w].store(0, std::memory_order_relaxed);
+        }
+        //следующее четное поколение оживляет места и делает старые ElementHandle устаревшими
+        if (SlotState *states = slotStates_.find(i))
+        {
+            for (unsigned int item = 0; item < elementsInBlock(); ++item)
+                states[item].generation.store((states[item].generation.load(std::memory_order_relaxed) | 1) + 1, std::memory_order_relaxed);
+        }
+    }
+    committed_.store(0);
+    freeHead_.store(0);
+    deadCount_.store(0);
+    //задаем значение сквозного индекса таким, чтобы первое выделение элемента привело к повторному использованию блока 0
+    setIndex(noBlock, elementsInBlock());
+}
+template <typename T, unsigned int BlockShift>
+MassAllocatorStats MassAllocator<T, BlockShift>::stats() const
 {
-    return blocks_.size() * elementsInBlockCount_ * sizeof(T);
+    MassAllocatorStats result = MassAllocatorStats();
+#ifdef MASS_ALLOCATOR_STATS
+    result.blocksAllocated = counters_.blocksAllocated.load();
+    result.blocksDiscarded = counters_.blocksDiscarded.load();
+    result.blocksZeroed = counters_.blocksZeroed.load();
+    result.blockAllocationNs = counters_.blockAllocationNs.load();
+    result.waitIterations = counters_.waitIterations.load();
+    result.waitNs = counters_.waitNs.load();
+    result.cacheSlotsReturned = counters_.cacheSlotsReturned.load();
+    result.cacheSlotsAbandoned = counters_.cacheSlotsAbandoned.load();
+    std::lock_guard<std::mutex> lock(threadCountersMutex_);
+    for (auto ii = threadCounters_.begin(), ie = threadCounters_.end(); ii != ie; ++ii)
+        result.threadAllocations.push_back(std::make_pair(ii->thread, ii->allocations.load()));
+#endif
+    return result;
 }
 
-template <typename T>
-void MassAllocator<T>::clear()
+#ifdef MASS_ALLOCATOR_STATS
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::ThreadCounter& MassAllocator<T, BlockShift>::threadCounter()
 {
-    //почистить все блоки данных
-    for(auto ii = blocks_.begin(); ii != blocks_.end(); ++ii)
-        free(*ii);
-    blocks_.clear();
-    //задаем значение сквозного индекса таким, чтобы первое выделение элемента привело к распределению нового блока
-    setIndex(0, elementsInBlockCount_);
+    //поток запоминает счетчик последнего хранилища, с которым работал
+    thread_local uint64_t cachedId = 0;
+    thread_local ThreadCounter *cachedCounter = nullptr;
+    if (cachedId == statsId_)
+        return *cachedCounter;
+
+    std::lock_guard<std::mutex> lock(threadCountersMutex_);
+    auto thread = std::this_thread::get_id();
+    auto ii = std::find_if(threadCounters_.begin(), threadCounters_.end(),
+        [&](const ThreadCounter &counter) { return counter.thread == thread; });
+    if (ii == threadCounters_.end())
+    {
+        ii = threadCounters_.emplace(threadCounters_.end());
+        ii->thread = thread;
+        ii->allocations = 0;
+    }
+    cachedId = statsId_;
+    cachedCounter = &*ii;
+    return *cachedCounter;
 }
+#endif
 //=============================================================================
 
-template <typename T>
-typename MassAllocator<T>::Iterator& MassAllocator<T>::Iterator::operator++()
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator& MassAllocator<T, BlockShift>::Iterator::operator++()
 {
     ++index_;
     return *this;
 }
 
-template <typename T>
-typename MassAllocator<T>::Iterator MassAllocator<T>::Iterator::operator++(int)
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator MassAllocator<T, BlockShift>::Iterator::operator++(int)
 {
     Iterator result(*this);
     ++index_;
     return result;
 }
 
-template <typename T>
-typename MassAllocator<T>::Iterator& MassAllocator<T>::Iterator::operator--()
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator& MassAllocator<T, BlockShift>::Iterator::operator--()
 {
     --index_;
     return *this;
 }
 
-template <typename T>
-typename MassAllocator<T>::Iterator MassAllocator<T>::Iterator::operator--(int)
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator MassAllocator<T, BlockShift>::Iterator::operator--(int)
 {
     Iterator result(*this);
     --index_;
     return result;
 }
 
-template <typename T>
-typename MassAllocator<T>::Iterator::difference_type MassAllocator<T>::Iterator::operator-(const Iterator &rh) const
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator::difference_type MassAllocator<T, BlockShift>::Iterator::operator-(const Iterator &rh) const
 {
     return index_ - rh.index_;
 }
 
-template <typename T>
-typename MassAllocator<T>::Iterator MassAllocator<T>::Iterator::operator-(typename MassAllocator<T>::Iterator::difference_type offset) const
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator MassAllocator<T, BlockShift>::Iterator::operator-(typename MassAllocator<T, BlockShift>::Iterator::difference_type offset) const
 {
-    MassAllocator<T>::Iterator result(*this);
+    MassAllocator<T, BlockShift>::Iterator result(*this);
     result.index_ -= offset;
     return result;
 }
 
-template <typename T>
-typename MassAllocator<T>::Iterator MassAllocator<T>::Iterator::operator+(typename MassAllocator<T>::Iterator::difference_type offset) const
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::Iterator MassAllocator<T, BlockShift>::Iterator::operator+(typename MassAllocator<T, BlockShift>::Iterator::difference_type offset) const
 {
-    MassAllocator<T>::Iterator result(*this);
+    MassAllocator<T, BlockShift>::Iterator result(*this);
     result.index_ += offset;
     return result;
 }
 
-template <typename T>
-typename MassAllocator<T>::pointer MassAllocator<T>::Iterator:: operator->()
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::pointer MassAllocator<T, BlockShift>::Iterator:: operator->()
 {
     return &(*MassAllocator_)[index_];
 }
 
-template <typename T>
-typename MassAllocator<T>::reference MassAllocator<T>::Iterator:: operator*()
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::reference MassAllocator<T, BlockShift>::Iterator:: operator*()
 {
     return (*MassAllocator_)[index_];
 }
 
-template <typename T>
-bool MassAllocator<T>::Iterator::operator==(const Iterator &rh) const
+template <typename T, unsigned int BlockShift>
+bool MassAllocator<T, BlockShift>::Iterator::operator==(const Iterator &rh) const
 {
     return index_ == rh.index_;
 }
 
-template <typename T>
-bool MassAllocator<T>::Iterator::operator<(const Iterator &rh) const
+template <typename T, unsigned int BlockShift>
+bool MassAllocator<T, BlockShift>::Iterator::operator<(const Iterator &rh) const
 {
     return index_ < rh.index_;
 }
 
-template <typename T>
-bool MassAllocator<T>::Iterator::operator!=(const Iterator &rh) const
+template <typename T, unsigned int BlockShift>
+bool MassAllocator<T, BlockShift>::Iterator::operator!=(const Iterator &rh) const
 {
     return !(*this == rh);
 }
 
-template <typename T>
-typename MassAllocator<T>::size_type MassAllocator<T>::Iterator::getIndex() const
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::size_type MassAllocator<T, BlockShift>::Iterator::getIndex() const
 {
     return index_;
 }
+//=============================================================================
+
+template <typename T, unsigned int BlockShift>
+MassAllocator<T, BlockShift>::ThreadCache::ThreadCache(MassAllocator &allocator, unsigned int chunkSize)
+    : allocator_(&allocator)
+    , chunkSize_(std::max(1u, std::min(chunkSize, allocator.elementsInBlock())))
+    , current_(nullptr)
+    , end_(nullptr)
+    , currentIndex_(0)
+    , publishedIndex_(0)
+    , hasNext_(false)
+{
+}
+
+template <typename T, unsigned int BlockShift>
+MassAllocator<T, BlockShift>::ThreadCache::~ThreadCache()
+{
+    flush();
+}
+
+template <typename T, unsigned int BlockShift>
+typename MassAllocator<T, BlockShift>::pointer MassAllocator<T, BlockShift>::ThreadCache::createElement(size_type *index)
+{
+    pointer result = nullptr;
+    size_type resultIndex = 0;
+    //сначала занимаем места освобожденных элементов, если они не будут видны до записи
+    if ((allocator_->options_ & (optionRecycle | optionTrackCommits)) == optionRecycle
+        && (allocator_->freeHead_.load(std::memory_order_relaxed) & freeIndexMask) != 0)
+        result = allocator_->reuseElement(&resultIndex);
+    if (result == nullptr)
+    {
+        if (current_ == end_)
+            refill();
+        resultIndex = currentIndex_++;
+        result = current_++;
+    }
+    constructElement(result);
+    if (index != nullptr)
+        *index = resultIndex;
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::ThreadCache::commit()
+{
+    if ((allocator_->options_ & optionTrackCommits) && currentIndex_ != publishedIndex_)
+    {
+        allocator_->commitRange(publishedIndex_, currentIndex_ - publishedIndex_);
+        publishedIndex_ = currentIndex_;
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::ThreadCache::refill()
+{
+    //текущий кусок выдан целиком, поток уже закончил запись его элементов
+    commit();
+    if (hasNext_)
+    {
+        current_ = next_.ptr;
+        end_ = next_.ptr + next_.count;
+        currentIndex_ = publishedIndex_ = next_.index;
+        hasNext_ = false;
+        return;
+    }
+    //порция не больше блока, поэтому она состоит не более чем из двух кусков.
+    //Элементы порции публикуются пакетом при следующем захвате
+    bool first = true;
+    auto takePiece =
+        [&]
+        (pointer ptr, size_type firstIndex, unsigned int count)
+        {
+            if (first)
+            {
+                current_ = ptr;
+                end_ = ptr + count;
+                currentIndex_ = publishedIndex_ = firstIndex;
+                first = false;
+            }
+            else
+            {
+                next_.ptr = ptr;
+                next_.index = firstIndex;
+                next_.count = count;
+                hasNext_ = true;
+            }
+        };
+    allocator_->claimImpl(chunkSize_, takePiece);
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::ThreadCache::flush()
+{
+    commit();
+    if (current_ == end_ && !hasNext_)
+        return;
+    auto blockSize = allocator_->elementsInBlock();
+    //конец захваченного диапазона и первый неиспользованный элемент в последнем куске
+    size_type endIndex = hasNext_ ? next_.index + next_.count : currentIndex_ + (end_ - current_);
+    size_type freeIndex = hasNext_ ? next_.index : currentIndex_;
+    //последний кусок может заканчиваться ровно на границе блока
+    uint64_t lastBlock = (endIndex - 1) / blockSize;
+    uint64_t expected = (lastBlock << 32) + (endIndex - lastBlock * blockSize);
+    uint64_t desired = (lastBlock << 32) + (freeIndex - lastBlock * blockSize);
+    //если после нас счетчик не менялся, то отдаем остаток обратно
+    bool returned = allocator_->curAtomicIndex_.compare_exchange_strong(expected, desired);
+    //невозвращенный остаток остается в хранилище элементами по умолчанию, их публикуем, чтобы не задерживать границу
+    if (!returned || hasNext_)
+        allocator_->abandon(current_, currentIndex_, end_ - current_);
+    if (!returned && hasNext_)
+        allocator_->abandon(next_.ptr, next_.index, next_.count);
+#ifdef MASS_ALLOCATOR_STATS
+    uint64_t unused = (end_ - current_) + (hasNext_ ? next_.count : 0);
+    uint64_t returnedCount = returned ? endIndex - freeIndex : 0;
+    allocator_->counters_.cacheSlotsReturned.fetch_add(returnedCount, std::memory_order_relaxed);
+    allocator_->counters_.cacheSlotsAbandoned.fetch_add(unused - returnedCount, std::memory_order_relaxed);
+#endif
+    current_ = end_ = nullptr;
+    hasNext_ = false;
+}
+//=============================================================================
+
+template <typename T, unsigned int BlockShift>
+void MassAllocator<T, BlockShift>::SegmentedIterator::setBlock(size_type blockIndx)
+{
+    size_type first = blockIndx * MassAllocator_->elementsInBlock();
+    blockIndx_ = blockIndx;
+    ptr_ = MassAllocator_->blocks_[(unsigned int)blockIndx];
+    blockEnd_ = ptr_ + std::min<size_type>(MassAllocator_->elementsInBlock(), size_ - first);
+}
@@ -0,0 +1,188 @@
+﻿#pragma once
+#include <vector>
+#include <memory>
+#include <iterator>
+#include <algorithm>
+#include <system_error>
+#include "massAllocator.h"
+
+/*! \file
+*Параллельные алгоритмы над содержимым MassAllocator.
+*Работа делится на непрерывные куски внутри блоков и раздается потокам через massParallelFor.
+*Освобожденные элементы хранилища с optionRecycle пропускаются.
+*/
+
+namespace massAllocatorDetail
+{
+    ///Наибольшее количество элементов в одной задаче. Блок большего размера делится на несколько задач.
+    const size_t parallelGrainSize = 16 * 1024;
+
+    ///Делит куски элементов блоков на задачи размером не больше grainSize.
+    template <typename Span>
+    std::vector<Span> splitSpans(const std::vector<Span> &spans, size_t grainSize)
+    {
+        std::vector<Span> result;
+        for (auto ii = spans.begin(), ie = spans.end(); ii != ie; ++ii)
+        {
+            for (size_t first = 0; first < ii->count; first += grainSize)
+            {
+                Span part = { ii->ptr + first, ii->index + first, std::min(grainSize, ii->count - first) };
+                result.push_back(part);
+            }
+        }
+        return result;
+    }
+
+    ///Сливает два отсортированных отрезка [x, x + xCount) и [y, y + yCount) в out,
+    ///разбивая слияние на partsCount независимых частей.
+    template <typename T, typename Compare>
+    void mergeParts(T *x, size_t xCount, T *y, size_t yCount, T *out, size_t partsCount, size_t part, Compare comp)
+    {
+        //граница части определяется элементом x, граница в y находится бинарным поиском
+        auto xSplit = [&](size_t k) { return k * xCount / partsCount; };
+        auto ySplit =
+            [&]
+            (size_t k)
+            {
+                size_t xi = xSplit(k);
+                if (xi == xCount)
+                    return yCount;
+                return (size_t)(std::lower_bound(y, y + yCount, x[xi], comp) - y);
+            };
+        size_t xFirst = xSplit(part), xLast = xSplit(part + 1);
+        size_t yFirst = part == 0 ? 0 : ySplit(part), yLast = ySplit(part + 1);
+        std::merge(
+            std::make_move_iterator(x + xFirst), std::make_move_iterator(x + xLast),
+            std::make_move_iterator(y + yFirst), std::make_move_iterator(y + yLast),
+            out + xFirst + yFirst,
+            comp);
+    }
+}
+
+///Вызывает f(element) для каждого живого элемента хранилища на нескольких потоках.
+template <typename T, unsigned int BlockShift, typename F>
+void parallelForEach(MassAllocator<T, BlockShift> &heap, F f, unsigned int threadsCount = 0)
+{
+    auto tasks = massAllocatorDetail::splitSpans(heap.segments(), massAllocatorDetail::parallelGrainSize);
+    massParallelFor(tasks.size(),
+        [&](size_t taskIndx)
+        {
+            heap.forEachAlive(tasks[taskIndx], [&](T &element, size_t) { f(element); });
+        },
+        threadsCount);
+}
+
+/*! \brief Параллельная свертка reduce(init, transform(element)...) по всем живым элементам хранилища.
+*Операция reduce должна быть ассоциативной и коммутативной, порядок применения к элементам не определен.
+*/
+template <typename T, unsigned int BlockShift, typename R, typename Reduce, typename Transform>
+R parallelTransformReduce(MassAllocator<T, BlockShift> &heap, R init, Reduce reduce, Transform transform, unsigned int threadsCount = 0)
+{
+    auto tasks = massAllocatorDetail::splitSpans(heap.segments(), massAllocatorDetail::parallelGrainSize);
+    //частичные результаты задач, задача из одних освобожденных элементов результата не дает
+    std::vector<std::unique_ptr<R>> partial(tasks.size());
+    massParallelFor(tasks.size(),
+        [&](size_t taskIndx)
+        {
+            std::unique_ptr<R> &acc = partial[taskIndx];
+            heap.forEachAlive(tasks[taskIndx],
+                [&](T &element, size_t)
+                {
+                    if (acc)
+                        *acc = reduce(std::move(*acc), transform(element));
+                    else
+                        acc.reset(new R(transform(element)));
+                });
+        },
+        threadsCount);
+
+    for (auto ii = partial.begin(), ie = partial.end(); ii != ie; ++ii)
+    {
+        if (*ii)
+            init = reduce(std::move(init), std::move(**ii));
+    }
+    return init;
+}
+
+///Параллельная свертка reduce(init, element...) по всем элементам хранилища.
+template <typename T, unsigned int BlockShift, typename R, typename Reduce>
+R parallelReduce(MassAllocator<T, BlockShift> &heap, R init, Reduce reduce, unsigned int threadsCount = 0)
+{
+    return parallelTransformReduce(heap, std::move(init), reduce, [](const T &element) -> const T& { return element; }, threadsCount);
+}
+
+/*! \brief Параллельная сортировка всех элементов хранилища.
+*Каждый кусок сортируется отдельно, затем отсортированные куски попарно сливаются,
+*пока не останется один; каждое слияние тоже делится между потоками. Требует память под две копии элементов.
+*Индексы элементов после сортировки меняются. Хранилище с optionRecycle не сортируется: битовые карты, поколения
+*и список свободных остались бы у старых индексов, поэтому бросается std::system_error с errc::operation_not_supported.
+*/
+template <typename T, unsigned int BlockShift, typename Compare>
+void parallelSort(MassAllocator<T, BlockShift> &heap, Compare comp, unsigned int threadsCount = 0)
+{
+    if (heap.options() & MassAllocator<T, BlockShift>::optionRecycle)
+        throw std::system_error(std::make_error_code(std::errc::operation_not_supported), "parallelSort: allocator with optionRecycle");
+    if (threadsCount == 0)
+        threadsCount = std::max(1u, std::thread::hardware_concurrency());
+
+    auto spans = heap.segments();
+    size_t n = spans.empty() ? 0 : spans.back().index + spans.back().count;
+    if (n < 2)
+        return;
+
+    //копируем куски в непрерывный буфер и сортируем каждый кусок
+    std::unique_ptr<T[]> buffer(new T[n]);
+    std::unique_ptr<T[]> mergeBuffer(new T[n]);
+    T *src = buffer.get();
+    T *dst = mergeBuffer.get();
+    massParallelFor(spans.size(),
+        [&](size_t spanIndx)
+        {
+            auto &span = spans[spanIndx];
+            std::copy(span.begin(), span.end(), src + span.index);
+            std::sort(src + span.index, src + span.index + span.count, comp);
+        },
+        threadsCount);
+
+    //границы отсортированных отрезков
+    std::vector<size_t> runs;
+    for (auto ii = spans.begin(), ie = spans.end(); ii != ie; ++ii)
+        runs.push_back(ii->index);
+    runs.push_back(n);
+
+    while (runs.size() > 2)
+    {
+        size_t runsCount = runs.size() - 1;
+        size_t pairsCount = (runsCount + 1) / 2;
+        //делим слияния так, чтобы хватило работы на все потоки
+        size_t partsCount = std::max<size_t>(1, (threadsCount * 4 + pairsCount - 1) / pairsCount);
+        massParallelFor(pairsCount * partsCount,
+            [&](size_t taskIndx)
+            {
+                size_t pair = taskIndx / partsCount;
+                size_t part = taskIndx % partsCount;
+                size_t first = runs[pair * 2];
+                size_t middle = runs[pair * 2 + 1];
+                size_t last = pair * 2 + 2 < runs.size() ? runs[pair * 2 + 2] : middle;
+                massAllocatorDetail::mergeParts(src + first, middle - first, src + middle, last - middle, dst + first, partsCount, part, comp);
+            },
+            threadsCount);
+
+        std::vector<size_t> merged;
+        for (size_t i = 0; i < runs.size(); i += 2)
+            merged.push_back(runs[i]);
+        if (merged.back() != n)
+            merged.push_back(n);
+        runs.swap(merged);
+        std::swap(src, dst);
+    }
+
+    //возвращаем отсортированные элементы в блоки
+    massParallelFor(spans.size(),
+        [&](size_t spanIndx)
+        {
+            auto &span = spans[spanIndx];
+            std::copy(src + span.index, src + span.index + span.count, span.ptr);
+        },
+        threadsCount);
+}
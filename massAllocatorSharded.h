@@ -0,0 +1,415 @@
+﻿#pragma once
+#include <vector>
+#include <memory>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include "massAllocator.h"
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fstream>
+#endif
+
+/*! \brief Хранилище из нескольких независимых цепочек блоков (шардов), по одной на узел NUMA или группу ядер.
+*Поток выделяет элементы в шарде своего процессора, поэтому общий счетчик не гоняется между сокетами,
+*а блоки первым касанием попадают в память локального узла. С optionBackgroundRefill блоки готовит фоновый поток,
+*и локальность первого касания теряется.
+*Сквозной индекс содержит номер шарда в старших битах и индекс в шарде в младших, индексы шардов не перекрываются,
+*но общая нумерация не непрерывна. operator[], forEachElement(), forEachBlock() и segments() работают с такими индексами.
+*/
+template <typename T, unsigned int BlockShift = 0>
+class MassAllocatorSharded
+{
+public:
+    typedef MassAllocator<T, BlockShift> Shard;
+    typedef typename Shard::size_type size_type;
+    typedef typename Shard::reference reference;
+    typedef typename Shard::const_reference const_reference;
+    typedef typename Shard::pointer pointer;
+    typedef typename Shard::Span Span;
+
+    ///Как разбивать процессоры на шарды.
+    enum ShardPolicy
+    {
+        ///Шард на каждый узел NUMA. Без сведений об узлах один шард.
+        shardByNode,
+        ///Процессоры делятся на shardsCount групп подряд идущих номеров.
+        shardByCoreGroup
+    };
+
+    ///Сдвиг номера шарда в сквозном индексе.
+    static constexpr unsigned int shardShift = 56;
+    ///Наибольшее количество шардов.
+    static constexpr unsigned int maxShards = 1u << (64 - shardShift);
+
+    /*! \brief Конструктор.
+    *Для shardByCoreGroup shardsCount = 0 означает шард на каждый процессор, для shardByNode параметр игнорируется.
+    *Количество шардов не больше maxShards: при большем количестве узлов NUMA узлы делят шарды по кругу.
+    *blockSize и options передаются хранилищам шардов.
+    */
+    MassAllocatorSharded(ShardPolicy policy = shardByNode, unsigned int shardsCount = 0,
+        unsigned int blockSize = Shard::defaultBlockSize, unsigned int options = Shard::optionDefault);
+
+    ///Создание нового элемента в шарде текущего процессора. Возвращается указатель на созданый элемент и его сквозной индекс.
+    pointer createElement(size_type *index = nullptr) { return createElementInShard(currentShard(), index); }
+
+    ///Создание нового элемента в заданном шарде.
+    pointer createElementInShard(unsigned int shard, size_type *index = nullptr);
+
+    ///Создание count элементов в шарде текущего процессора. Индексы кусков сквозные.
+    std::vector<Span> createElements(size_type count);
+
+    ///Возвращает элемент по сквозному индексу
+    reference operator[](size_type index) { return (*shards_[shardOf(index)])[localIndex(index)]; }
+
+    ///Возвращает элемент по сквозному индексу
+    const_reference operator[](size_type index) const { return (*shards_[shardOf(index)])[localIndex(index)]; }
+
+    ///Номер шарда по сквозному индексу.
+    static unsigned int shardOf(size_type index) { return (unsigned int)(index >> shardShift); }
+
+    ///Индекс в шарде по сквозному индексу.
+    static size_type localIndex(size_type index) { return index & (((size_type)1 << shardShift) - 1); }
+
+    ///Сквозной индекс по номеру шарда и индексу в шарде.
+    static size_type globalIndex(unsigned int shard, size_type local) { return ((size_type)shard << shardShift) | local; }
+
+    ///Количество шардов.
+    unsigned int shardsCount() const { return (unsigned int)shards_.size(); }
+
+    ///Хранилище шарда.
+    Shard& shard(unsigned int shardIndx) { return *shards_[shardIndx]; }
+
+    ///Шард процессора, на котором выполняется текущий поток.
+    unsigned int currentShard() const;
+
+    ///Вызывает f(reference, сквозной индекс) для всех живых элементов в порядке возрастания сквозных индексов.
+    template <typename F>
+    void forEachElement(F f);
+
+    ///Вызывает f(pointer, количество) для непрерывного куска элементов каждого блока всех шардов по порядку.
+    template <typename F>
+    void forEachBlock(F f);
+
+    ///Возвращает непрерывные куски элементов всех блоков всех шардов, индексы кусков сквозные.
+    ///С optionRecycle куски включают места освобожденных элементов.
+    std::vector<Span> segments();
+
+    /*! \brief Параллельно вызывает f(span) для кусков всех шардов.
+    *Куски шарда обрабатывают threadsPerShard потоков, привязанных к процессорам этого шарда, поэтому память
+    *читается с локального узла. threadsPerShard = 0 означает количество процессоров шарда.
+    *С optionRecycle куски включают места освобожденных элементов.
+    */
+    template <typename F>
+    void parallelForEachSpan(F f, unsigned int threadsPerShard = 0);
+
+    ///Kоличество элементов во всех шардах
+    size_t size() const;
+
+    ///Очищает все шарды.
+    void clear();
+
+    ///Очищает все шарды, освобождая блоки в фоновых потоках. См. MassAllocator::clearAsync().
+    void clearAsync();
+
+    ///Возвращает потребление памяти
+    size_t memUse() const;
+private:
+    //Запрет копирования
+    MassAllocatorSharded(const MassAllocatorSharded &);
+    MassAllocatorSharded& operator=(const MassAllocatorSharded &);
+
+    ///Хранилища шардов.
+    std::vector<std::unique_ptr<Shard>> shards_;
+    ///Шард каждого процессора.
+    std::vector<unsigned int> cpuShard_;
+    ///Процессоры каждого шарда.
+    std::vector<std::vector<unsigned int>> shardCpus_;
+
+    ///Узел NUMA каждого процессора по /sys/devices/system/node, пустой вектор, если сведений нет.
+    static std::vector<unsigned int> cpuNodes();
+
+    ///Разбирает список процессоров вида "0-3,8,10-11".
+    static std::vector<unsigned int> parseCpuList(const std::string &list);
+
+    ///Привязывает текущий поток к процессорам шарда.
+    void bindToShard(unsigned int shardIndx) const;
+};
+
+template <typename T, unsigned int BlockShift>
+MassAllocatorSharded<T, BlockShift>::MassAllocatorSharded(ShardPolicy policy, unsigned int shardsCount, unsigned int blockSize, unsigned int options)
+{
+    unsigned int cpusCount = std::max(1u, std::thread::hardware_concurrency());
+    if (policy == shardByNode)
+    {
+        //номера узлов могут идти с пропусками, шарды нумеруем подряд
+        std::vector<unsigned int> nodes = cpuNodes();
+        std::vector<unsigned int> nodeIds(nodes);
+        std::sort(nodeIds.begin(), nodeIds.end());
+        nodeIds.erase(std::unique(nodeIds.begin(), nodeIds.end()), nodeIds.end());
+        cpusCount = std::max(cpusCount, (unsigned int)nodes.size());
+        cpuShard_.assign(cpusCount, 0);
+        for (unsigned int cpu = 0; cpu < nodes.size(); ++cpu)
+            cpuShard_[cpu] = (unsigned int)(std::lower_bound(nodeIds.begin(), nodeIds.end(), nodes[cpu]) - nodeIds.begin()) % maxShards;
+        shardsCount = std::max<unsigned int>(1, std::min((unsigned int)nodeIds.size(), maxShards));
+    }
+    else
+    {
+        if (shardsCount == 0)
+            shardsCount = cpusCount;
+        shardsCount = std::min(shardsCount, maxShards);
+        //группы подряд идущих процессоров примерно одного размера
+        cpuShard_.resize(cpusCount);
+        for (unsigned int cpu = 0; cpu < cpusCount; ++cpu)
+            cpuShard_[cpu] = (unsigned int)((uint64_t)cpu * shardsCount / cpusCount);
+    }
+
+    shardCpus_.resize(shardsCount);
+    for (unsigned int cpu = 0; cpu < cpuShard_.size(); ++cpu)
+        shardCpus_[cpuShard_[cpu]].push_back(cpu);
+    for (unsigned int i = 0; i < shardsCount; ++i)
+        shards_.push_back(std::unique_ptr<Shard>(new Shard(blockSize, options)));
+}
+
+template <typename T, unsigned int BlockShift>
+unsigned int MassAllocatorSharded<T, BlockShift>::currentShard() const
+{
+#ifdef __linux__
+    //номер процессора перечитываем время от времени: поток может переехать на другое ядро
+    thread_local unsigned int cpu = 0;
+    thread_local unsigned int countdown = 0;
+    if (countdown-- == 0)
+    {
+        int current = sched_getcpu();
+        cpu = current < 0 ? 0 : (unsigned int)current;
+        countdown = 255;
+    }
+#else
+    thread_local unsigned int cpu = (unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+    return cpu < cpuShard_.size() ? cpuShard_[cpu] : cpu % shardsCount();
+}
+
+template <typename T, unsigned int BlockShift>
+typename MassAllocatorSharded<T, BlockShift>::pointer MassAllocatorSharded<T, BlockShift>::createElementInShard(unsigned int shardIndx, size_type *index)
+{
+    size_type local;
+    pointer result = shards_[shardIndx]->createElement(&local);
+    if (index != nullptr)
+        *index = globalIndex(shardIndx, local);
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+std::vector<typename MassAllocatorSharded<T, BlockShift>::Span> MassAllocatorSharded<T, BlockShift>::createElements(size_type count)
+{
+    unsigned int shardIndx = currentShard();
+    auto result = shards_[shardIndx]->createElements(count);
+    for (auto ii = result.begin(), ie = result.end(); ii != ie; ++ii)
+        ii->index = globalIndex(shardIndx, ii->index);
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+template <typename F>
+void MassAllocatorSharded<T, BlockShift>::forEachElement(F f)
+{
+    //номер шарда в старших битах, поэтому шарды по порядку дают возрастающие сквозные индексы
+    for (unsigned int shardIndx = 0; shardIndx < shardsCount(); ++shardIndx)
+    {
+        shards_[shardIndx]->forEachAlive(
+            [&](reference element, size_type local)
+            {
+                f(element, globalIndex(shardIndx, local));
+            });
+    }
+}
+
+template <typename T, unsigned int BlockShift>
+template <typename F>
+void MassAllocatorSharded<T, BlockShift>::forEachBlock(F f)
+{
+    for (auto ii = shards_.begin(), ie = shards_.end(); ii != ie; ++ii)
+        (*ii)->forEachBlock(f);
+}
+
+template <typename T, unsigned int BlockShift>
+std::vector<typename MassAllocatorSharded<T, BlockShift>::Span> MassAllocatorSharded<T, BlockShift>::segments()
+{
+    std::vector<Span> result;
+    for (unsigned int shardIndx = 0; shardIndx < shardsCount(); ++shardIndx)
+    {
+        auto spans = shards_[shardIndx]->segments();
+        for (auto ii = spans.begin(), ie = spans.end(); ii != ie; ++ii)
+        {
+            ii->index = globalIndex(shardIndx, ii->index);
+            result.push_back(*ii);
+        }
+    }
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+template <typename F>
+void MassAllocatorSharded<T, BlockShift>::parallelForEachSpan(F f, unsigned int threadsPerShard)
+{
+    std::vector<std::vector<Span>> shardSpans(shardsCount());
+    std::vector<std::unique_ptr<std::atomic<size_t>>> nextSpan;
+    for (unsigned int shardIndx = 0; shardIndx < shardsCount(); ++shardIndx)
+    {
+        shardSpans[shardIndx] = shards_[shardIndx]->segments();
+        for (auto ii = shardSpans[shardIndx].begin(), ie = shardSpans[shardIndx].end(); ii != ie; ++ii)
+            ii->index = globalIndex(shardIndx, ii->index);
+        nextSpan.push_back(std::unique_ptr<std::atomic<size_t>>(new std::atomic<size_t>(0)));
+    }
+
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    std::vector<std::thread> threads;
+    for (unsigned int shardIndx = 0; shardIndx < shardsCount(); ++shardIndx)
+    {
+        if (shardSpans[shardIndx].empty())
+            continue;
+        unsigned int threadsCount = threadsPerShard != 0 ? threadsPerShard : std::max<unsigned int>(1, (unsigned int)shardCpus_[shardIndx].size());
+        for (unsigned int i = 0; i < threadsCount; ++i)
+        {
+            threads.push_back(std::thread(
+                [&, shardIndx]
+                ()
+                {
+                    bindToShard(shardIndx);
+                    auto &spans = shardSpans[shardIndx];
+                    auto &next = *nextSpan[shardIndx];
+                    try
+                    {
+                        for (size_t spanIndx = next++; spanIndx < spans.size(); spanIndx = next++)
+                            f(spans[spanIndx]);
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard<std::mutex> lock(errorMutex);
+                        if (!error)
+                            error = std::current_exception();
+                        next = spans.size();
+                    }
+                }));
+        }
+    }
+    for (auto ii = threads.begin(), ie = threads.end(); ii != ie; ++ii)
+        ii->join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+template <typename T, unsigned int BlockShift>
+size_t MassAllocatorSharded<T, BlockShift>::size() const
+{
+    size_t result = 0;
+    for (auto ii = shards_.begin(), ie = shards_.end(); ii != ie; ++ii)
+        result += (*ii)->size();
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocatorSharded<T, BlockShift>::clear()
+{
+    for (auto ii = shards_.begin(), ie = shards_.end(); ii != ie; ++ii)
+        (*ii)->clear();
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocatorSharded<T, BlockShift>::clearAsync()
+{
+    for (auto ii = shards_.begin(), ie = shards_.end(); ii != ie; ++ii)
+        (*ii)->clearAsync();
+}
+
+template <typename T, unsigned int BlockShift>
+size_t MassAllocatorSharded<T, BlockShift>::memUse() const
+{
+    size_t result = 0;
+    for (auto ii = shards_.begin(), ie = shards_.end(); ii != ie; ++ii)
+        result += (*ii)->memUse();
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+std::vector<unsigned int> MassAllocatorSharded<T, BlockShift>::parseCpuList(const std::string &list)
+{
+    std::vector<unsigned int> result;
+    size_t pos = 0;
+    while (pos < list.size())
+    {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        try
+        {
+            unsigned int first = (unsigned int)std::stoul(range.substr(0, dash));
+            unsigned int last = dash == std::string::npos ? first : (unsigned int)std::stoul(range.substr(dash + 1));
+            for (unsigned int cpu = first; cpu <= last; ++cpu)
+                result.push_back(cpu);
+        }
+        catch (const std::exception &)
+        {
+            //пустой или поврежденный кусок списка пропускаем
+        }
+        pos = end + 1;
+    }
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+std::vector<unsigned int> MassAllocatorSharded<T, BlockShift>::cpuNodes()
+{
+    std::vector<unsigned int> result;
+#ifdef __linux__
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == nullptr)
+        return result;
+    while (dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        if (name.compare(0, 4, "node") != 0 || name.size() == 4 || name.find_first_not_of("0123456789", 4) != std::string::npos)
+            continue;
+        unsigned int node = (unsigned int)std::stoul(name.substr(4));
+        std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+        std::string list;
+        std::getline(file, list);
+        auto cpus = parseCpuList(list);
+        for (auto ii = cpus.begin(), ie = cpus.end(); ii != ie; ++ii)
+        {
+            if (*ii >= result.size())
+                result.resize(*ii + 1, 0);
+            result[*ii] = node;
+        }
+    }
+    closedir(dir);
+#endif
+    return result;
+}
+
+template <typename T, unsigned int BlockShift>
+void MassAllocatorSharded<T, BlockShift>::bindToShard(unsigned int shardIndx) const
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (auto ii = shardCpus_[shardIndx].begin(), ie = shardCpus_[shardIndx].end(); ii != ie; ++ii)
+    {
+        if (*ii < CPU_SETSIZE)
+            CPU_SET(*ii, &cpus);
+    }
+    //привязка только улучшает локальность, ошибку игнорируем
+    if (CPU_COUNT(&cpus) != 0)
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+    (void)shardIndx;
+#endif
+}
@@ -0,0 +1,246 @@
+﻿#pragma once
+#include <tuple>
+#include <cstddef>
+#include <vector>
+#include <utility>
+#include <type_traits>
+#include "massAllocator.h"
+
+/*! \brief Хранилище записей из полей Fields, каждое поле которых лежит в своем столбце внутри блока.
+*Выделение элементов и сквозной индекс те же, что у MassAllocator: блок MassAllocator используется как память
+*под столбцы всех полей блока. Проход по одному полю читает только его столбец, а непрерывные столбцы
+*блока (segments(), forEachColumnBlock()) удобно обрабатывать векторными инструкциями.
+*Поля должны быть тривиальными типами, новый элемент инициализируется нулями.
+*Размер блока округляется вверх до кратного 64, поэтому каждый столбец выровнен на 64 байта относительно начала блока.
+*/
+template <typename... Fields>
+class MassAllocatorSoA
+{
+    static_assert(sizeof...(Fields) != 0, "at least one field is required");
+    static_assert((std::is_trivially_copyable_v<Fields> && ...) && (std::is_trivially_default_constructible_v<Fields> && ...),
+        "fields must be trivial types");
+    static_assert(((alignof(Fields) <= alignof(std::max_align_t)) && ...), "over-aligned fields are not supported");
+public:
+    typedef size_t size_type;
+    ///Ссылки на поля одного элемента, поддерживают структурное связывание: auto [a, b] = heap[i];
+    typedef std::tuple<Fields&...> reference;
+    typedef std::tuple<const Fields&...> const_reference;
+
+    ///Тип поля с номером Column.
+    template <size_t Column>
+    using field_type = std::tuple_element_t<Column, std::tuple<Fields...>>;
+
+    ///Количество полей.
+    static const size_t columnsCount = sizeof...(Fields);
+
+    ///Размер блока по умолчанию.
+    static const unsigned int defaultBlockSize = 1024 * 128;
+
+    ///Конструктор. Параметр options принимает флаги MassAllocator::Options.
+    MassAllocatorSoA(unsigned int blockSize = defaultBlockSize, unsigned int options = 0);
+
+    ///Создание нового элемента. Возвращаются ссылки на поля созданного элемента и его индекс.
+    reference createElement(size_type *index = nullptr);
+
+    ///Возвращает ссылки на поля элемента по индексу
+    reference operator[](size_type index) { return makeReference(columnBase(index), offsetInBlock(index), Indices()); }
+
+    ///Возвращает ссылки на поля элемента по индексу
+    const_reference operator[](size_type index) const { return makeReference(columnBase(index), offsetInBlock(index), Indices()); }
+
+    ///Возвращает поле Column элемента по индексу
+    template <size_t Column>
+    field_type<Column>& get(size_type index) { return column<Column>(columnBase(index))[offsetInBlock(index)]; }
+
+    ///Непрерывный кусок элементов внутри одного блока: для каждого поля свой непрерывный массив.
+    struct Span
+    {
+        ///Индекс первого элемента куска
+        size_type index;
+        ///Количество элементов в куске
+        size_type count;
+        ///Указатели на первый элемент куска в столбце каждого поля
+        std::tuple<Fields*...> columns;
+
+        ///Указатель на первый элемент куска в столбце поля Column
+        template <size_t Column>
+        field_type<Column>* column() const { return std::get<Column>(columns); }
+    };
+
+    /*! \brief Создание count элементов одной атомарной операцией.
+    *Элементы получают подряд идущие индексы, диапазон, пересекающий границу блока, возвращается несколькими кусками.
+    */
+    std::vector<Span> createElements(size_type count);
+
+    ///Возвращает непрерывные куски элементов всех блоков.
+    std::vector<Span> segments();
+
+    ///Вызывает f(указатель на столбец поля Column, количество) для каждого блока.
+    template <size_t Column, typename F>
+    void forEachColumnBlock(F f);
+
+    ///Вызывает f(индекс первого элемента, количество, указатели на столбцы всех полей...) для каждого блока.
+    template <typename F>
+    void forEachBlock(F f);
+
+    ///Заранее создает блоки для первых count элементов.
+    void reserve(size_type count, bool prefault = false) { storage_.reserve(count, prefault); }
+
+    ///Kоличество элементов
+    size_t size() const { return storage_.size(); }
+
+    ///Очищает хранилище, сбрасывает индекс.
+    void clear() { storage_.clear(); }
+
+    ///Очищает хранилище, освобождая блоки в фоновом потоке. См. MassAllocator::clearAsync().
+    void clearAsync(unsigned int threadsCount = 1) { storage_.clearAsync(threadsCount); }
+
+    ///Сбрасывает индекс, сохраняя выделенные блоки для следующего заполнения. См. MassAllocator::reset().
+    void reset() { storage_.reset(); }
+
+    ///Реализована ли lock-free семантика
+    bool is_lock_free() const { return storage_.is_lock_free(); }
+
+    ///Возвращает потребление памяти
+    size_t memUse() const { return storage_.memUse(); }
+private:
+    typedef std::index_sequence_for<Fields...> Indices;
+
+    ///Размер одной записи: сумма размеров всех полей.
+    static constexpr size_t rowBytes = (sizeof(Fields) + ...);
+
+    ///Память блока в пересчете на один элемент. Блок из elementsInBlock_ строк вмещает все столбцы.
+    struct Row
+    {
+        unsigned char bytes[rowBytes];
+    };
+
+    ///Смещение столбца Column от начала блока в пересчете на один элемент: сумма размеров предыдущих полей.
+    template <size_t Column>
+    static constexpr size_t columnPrefix()
+    {
+        constexpr size_t sizes[] = { sizeof(Fields)... };
+        size_t prefix = 0;
+        for (size_t i = 0; i < Column; ++i)
+            prefix += sizes[i];
+        return prefix;
+    }
+
+    ///Количество элементов в блоке.
+    unsigned int elementsInBlock_;
+    ///Блоки и сквозной индекс.
+    MassAllocator<Row> storage_;
+
+    ///Индекс элемента в блоке по сквозному индексу элемента.
+    unsigned int offsetInBlock(size_type index) const { return (unsigned int)(index % elementsInBlock_); }
+
+    ///Начало блока, в котором лежит элемент index.
+    unsigned char* columnBase(size_type index) const
+    {
+        return const_cast<Row&>(storage_[index - offsetInBlock(index)]).bytes;
+    }
+
+    ///Начало столбца поля Column в блоке base.
+    template <size_t Column>
+    field_type<Column>* column(unsigned char *base) const
+    {
+        return (field_type<Column>*)(base + columnPrefix<Column>() * elementsInBlock_);
+    }
+
+    template <size_t... Columns>
+    reference makeReference(unsigned char *base, unsigned int offset, std::index_sequence<Columns...>)
+    {
+        return reference(column<Columns>(base)[offset]...);
+    }
+
+    template <size_t... Columns>
+    const_reference makeReference(unsigned char *base, unsigned int offset, std::index_sequence<Columns...>) const
+    {
+        return const_reference(column<Columns>(base)[offset]...);
+    }
+
+    template <size_t... Columns>
+    Span makeSpan(unsigned char *base, size_type index, size_type count, std::index_sequence<Columns...>) const
+    {
+        Span span = { index, count, std::tuple<Fields*...>((column<Columns>(base) + offsetInBlock(index))...) };
+        return span;
+    }
+
+    template <typename F, size_t... Columns>
+    void callBlock(F &f, const Span &span, std::index_sequence<Columns...>)
+    {
+        f(span.index, span.count, span.template column<Columns>()...);
+    }
+
+    ///Переводит кусок элементов хранилища строк в кусок столбцов.
+    Span toSpan(const typename MassAllocator<Row>::Span &rows) const
+    {
+        unsigned char *base = (unsigned char*)(rows.ptr - offsetInBlock(rows.index));
+        return makeSpan(base, rows.index, rows.count, Indices());
+    }
+};
+
+template <typename... Fields>
+MassAllocatorSoA<Fields...>::MassAllocatorSoA(unsigned int blockSize, unsigned int options)
+    : elementsInBlock_((std::max(1u, blockSize) + 63) & ~63u)
+    , storage_(elementsInBlock_, options)
+{
+}
+
+template <typename... Fields>
+typename MassAllocatorSoA<Fields...>::reference MassAllocatorSoA<Fields...>::createElement(size_type *returningIndex)
+{
+    size_type index;
+    Row *row = storage_.createElement(&index);
+    if (returningIndex != nullptr)
+        *returningIndex = index;
+    //строка с номером offset в блоке задает только индекс, поля лежат в столбцах
+    unsigned int offset = offsetInBlock(index);
+    return makeReference((unsigned char*)(row - offset), offset, Indices());
+}
+
+template <typename... Fields>
+std::vector<typename MassAllocatorSoA<Fields...>::Span> MassAllocatorSoA<Fields...>::createElements(size_type count)
+{
+    std::vector<Span> result;
+    auto rows = storage_.createElements(count);
+    result.reserve(rows.size());
+    for (auto ii = rows.begin(), ie = rows.end(); ii != ie; ++ii)
+        result.push_back(toSpan(*ii));
+    return result;
+}
+
+template <typename... Fields>
+std::vector<typename MassAllocatorSoA<Fields...>::Span> MassAllocatorSoA<Fields...>::segments()
+{
+    std::vector<Span> result;
+    auto rows = storage_.segments();
+    result.reserve(rows.size());
+    for (auto ii = rows.begin(), ie = rows.end(); ii != ie; ++ii)
+        result.push_back(toSpan(*ii));
+    return result;
+}
+
+template <typename... Fields>
+template <size_t Column, typename F>
+void MassAllocatorSoA<Fields...>::forEachColumnBlock(F f)
+{
+    storage_.forEachBlock(
+        [&](Row *rows, size_type count)
+        {
+            f(column<Column>((unsigned char*)rows), count);
+        });
+}
+
+template <typename... Fields>
+template <typename F>
+void MassAllocatorSoA<Fields...>::forEachBlock(F f)
+{
+    size_type first = 0;
+    storage_.forEachBlock(
+        [&](Row *rows, size_type count)
+        {
+            callBlock(f, makeSpan((unsigned char*)rows, first, count, Indices()), Indices());
+            first += count;
+        });
+}
@@ -0,0 +1,173 @@
+﻿#pragma once
+#include <cstddef>
+#include <new>
+#include <mutex>
+#include <vector>
+#include <memory_resource>
+#include "massAllocator.h"
+
+/*! \brief Байтовая арена на блоках MassAllocator.
+*Память выделяется захватом подряд идущих 16-байтных гранул внутри одного блока той же lock-free операцией,
+*что и элементы MassAllocator. Освобождение отдельных участков ничего не делает, вся память возвращается сразу
+*в reset() или clear(). Запросы больше четверти блока выделяются отдельно и освобождаются там же.
+*Доступна как std::pmr::memory_resource и через типизированный STL аллокатор MassArenaAllocator.
+*/
+class MassArena : public std::pmr::memory_resource
+{
+public:
+    ///Размер гранулы и гарантированное выравнивание выделенной памяти без дополнительного запаса.
+    static const size_t granuleSize = 16;
+
+    ///Размер блока по умолчанию в байтах.
+    static const size_t defaultBlockBytes = 1024 * 1024;
+
+    ///Конструктор. blockBytes округляется до гранулы. Параметр options принимает флаги MassAllocator::Options.
+    explicit MassArena(size_t blockBytes = defaultBlockBytes, unsigned int options = 0)
+        : granulesInBlock_((unsigned int)std::max<size_t>(1, (blockBytes + granuleSize - 1) / granuleSize))
+        , granules_(granulesInBlock_, options)
+    {
+    }
+
+    ///Деструктор.
+    ~MassArena() { releaseLarge(); }
+
+    /*! \brief Освобождает всю выделенную память, сохраняя блоки для следующего заполнения.
+    *Нельзя вызывать одновременно с выделением, выделенные раньше участки после этого недействительны.
+    */
+    void reset()
+    {
+        releaseLarge();
+        //содержимое гранул не обязано быть нулевым
+        granules_.reset(MassAllocator<Granule>::zeroNone);
+    }
+
+    ///Освобождает всю выделенную память вместе с блоками.
+    void clear()
+    {
+        releaseLarge();
+        granules_.clear();
+    }
+
+    ///Освобождает всю выделенную память, блоки освобождаются в фоновом потоке. См. MassAllocator::clearAsync().
+    void clearAsync()
+    {
+        releaseLarge();
+        granules_.clearAsync();
+    }
+
+    ///Байты, занятые в блоках, включая пропущенные остатки блоков и запас на выравнивание.
+    size_t usedBytes() const { return granules_.size() * granuleSize; }
+
+    ///Возвращает потребление памяти блоками.
+    size_t memUse() const { return granules_.memUse(); }
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        //запас под выравнивание сильнее гранулы
+        size_t padding = alignment > granuleSize ? alignment - granuleSize : 0;
+        size_t granules = std::max<size_t>(1, (bytes + padding + granuleSize - 1) / granuleSize);
+        if (granules > granulesInBlock_ / 4)
+            return allocateLarge(bytes, alignment);
+
+        auto span = granules_.createElementsInBlock((unsigned int)granules);
+        uintptr_t address = (uintptr_t)span.ptr;
+        return (void*)((address + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    }
+
+    ///Отдельные участки не освобождаются до reset().
+    void do_deallocate(void *, size_t, size_t) override
+    {
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        return this == &other;
+    }
+private:
+    //Запрет копирования
+    MassArena(const MassArena &);
+    MassArena& operator=(const MassArena &);
+
+    struct alignas(granuleSize) Granule
+    {
+        unsigned char bytes[granuleSize];
+    };
+
+    ///Количество гранул в блоке.
+    unsigned int granulesInBlock_;
+    ///Блоки гранул и сквозной индекс.
+    MassAllocator<Granule> granules_;
+
+    ///Большой участок, выделенный отдельно от блоков.
+    struct LargeChunk
+    {
+        void *ptr;
+        size_t alignment;
+    };
+    std::vector<LargeChunk> large_;
+    std::mutex largeMutex_;
+
+    void* allocateLarge(size_t bytes, size_t alignment)
+    {
+        void *ptr = ::operator new(bytes, std::align_val_t(alignment));
+        std::lock_guard<std::mutex> lock(largeMutex_);
+        try
+        {
+            LargeChunk chunk = { ptr, alignment };
+            large_.push_back(chunk);
+        }
+        catch (...)
+        {
+            ::operator delete(ptr, std::align_val_t(alignment));
+            throw;
+        }
+        return ptr;
+    }
+
+    void releaseLarge()
+    {
+        std::lock_guard<std::mutex> lock(largeMutex_);
+        for (auto ii = large_.begin(), ie = large_.end(); ii != ie; ++ii)
+            ::operator delete(ii->ptr, std::align_val_t(ii->alignment));
+        large_.clear();
+    }
+};
+
+/*! \brief Типизированный STL аллокатор поверх MassArena.
+*deallocate() ничего не делает, память возвращается при reset() арены. Копии аллокатора равны, если у них общая арена.
+*/
+template <typename T>
+class MassArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit MassArenaAllocator(MassArena &arena) noexcept : arena_(&arena) {}
+
+    template <typename U>
+    MassArenaAllocator(const MassArenaAllocator<U> &other) noexcept : arena_(other.arena_) {}
+
+    T* allocate(size_t n)
+    {
+        if (n > (size_t)-1 / sizeof(T))
+            throw std::bad_array_new_length();
+        return (T*)arena_->allocate(n * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T *, size_t) noexcept
+    {
+    }
+
+    ///Арена, из которой выделяется память.
+    MassArena& arena() const { return *arena_; }
+
+    template <typename U>
+    bool operator==(const MassArenaAllocator<U> &rh) const noexcept { return arena_ == rh.arena_; }
+    template <typename U>
+    bool operator!=(const MassArenaAllocator<U> &rh) const noexcept { return arena_ != rh.arena_; }
+private:
+    template <typename U>
+    friend class MassArenaAllocator;
+
+    MassArena *arena_;
+};